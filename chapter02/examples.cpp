@@ -4,6 +4,14 @@
 #include "iostream"
 #include "vector"
 #include "algorithm"
+#include "future"
+#include "iterator"
+#include "memory"
+#include "type_traits"
+#include "chapter02/joining_thread.h"
+#include "chapter02/simd_reduction.h"
+#include "chapter08/parallel_algorithms.h"
+#include "chapter09_advanced_thread_management/thread_pool.h"
 
 void doSomething(unsigned i) {
     std::cout << "Doing something in thread with ID = " << std::this_thread::get_id()
@@ -51,144 +59,161 @@ void f() {
     ScopedThread t{std::thread(Func(someLocalState))};
 }
 
-/**
- * Wrapper class over std::thread that supports standard thread operations
- * but joins the thread it owns in its destructor. It also supports move semantics.
- */
-class JoiningThread {
-    std::thread t;
-public:
-    JoiningThread() noexcept = default;
-
-    template<class Callable, typename ... Args>
-    explicit JoiningThread(Callable &&func, Args &&... args) :
-            t(std::forward<Callable>(func), std::forward<Args>(args)...) {}
-
-    explicit JoiningThread(std::thread t_) noexcept: t(std::move(t_)) {}
-
-    JoiningThread(JoiningThread &&other) noexcept: t(std::move(other.t)) {}
-
-    JoiningThread &operator=(JoiningThread &&other) noexcept {
-        if (joinable()) {
-            join();
-        }
-        t = std::move(other.t);
-        return *this;
-    }
-
-    JoiningThread &operator=(std::thread other) noexcept {
-        if (joinable()) {
-            join();
-        }
-        t = std::move(other);
-        return *this;
-    }
-
-    ~JoiningThread() noexcept {
-        if (joinable()) {
-            join();
-        }
-    }
-
-    void swap(JoiningThread &other) noexcept {
-        t.swap(other.t);
-    }
-
-    std::thread::id get_id() const noexcept {
-        return t.get_id();
-    }
-
-    bool joinable() {
-        return t.joinable();
-    }
-
-    void join() {
-        t.join();
-    }
-
-    void detach() {
-        t.detach();
-    }
-
-    std::thread &asThread() noexcept {
-        return t;
-    }
-
-    const std::thread &asThread() const noexcept {
-        return t;
-    }
-};
-
 /**
  * Example function that shows that threads can be placed in a container that
  * supports move semantics. Here it is a std::vector.
  */
 void g() {
     std::vector<std::thread> threads;
+    // joins the threads started so far even if starting the next one throws
+    join_threads joiner(threads);
     for (unsigned i = 0; i < 20; ++i) {
         threads.emplace_back(doSomething, i); // spawn threads
     }
-    for (auto &t : threads) {
-        t.join();
-    }
 }
 
+/**
+ * Iterators known to point into contiguous memory: pointers and std::vector iterators.
+ */
+template<typename Iterator>
+constexpr bool isContiguousIterator =
+        std::is_pointer_v<Iterator> ||
+        std::is_same_v<Iterator, typename std::vector<typename std::iterator_traits<Iterator>::value_type>::iterator> ||
+        std::is_same_v<Iterator, typename std::vector<typename std::iterator_traits<Iterator>::value_type>::const_iterator>;
+
+/**
+ * Blocks of floats and doubles stored contiguously are reduced with the SIMD kernels,
+ * as long as the result has the same type as the elements.
+ */
+template<typename Iterator, typename T>
+constexpr bool usesSimdKernels = simd::isSupported<T> &&
+                                 std::is_same_v<typename std::iterator_traits<Iterator>::value_type, T> &&
+                                 isContiguousIterator<Iterator>;
+
 template<typename Iterator, typename T>
 struct AccumulateBlock {
     void operator()(Iterator first, Iterator last, T &result) {
-        result = std::accumulate(first, last, result);
+        if constexpr (usesSimdKernels<Iterator, T>) {
+            if (first != last) {
+                result += simd::sum(std::addressof(*first), std::distance(first, last));
+            }
+        } else {
+            result = std::accumulate(first, last, result);
+        }
     }
 };
 
 /**
- * Naive implementation of a parallel accumulate algorithm.
+ * Parallel reduction engine shared by parallelAccumulate and the other reductions below.
+ * The range is split into blocks by the chunking layer of the parallel algorithms (block_count,
+ * run_blocks), so it runs on the pool's workers and rethrows the first exception of a block.
+ * Every block stores its result in a padded partial.
+ * To run the reduction on workers pinned to CPUs, pass a pool constructed with pinning enabled.
  * @tparam Iterator
  * @tparam T
  * @param first
  * @param last
  * @param init
+ * @param reduceBlock called as reduceBlock(blockFirst, blockLast) on a non-empty block, returns T.
+ * @param combine combines two results, called in the order of the blocks starting with [init].
+ * @param pool
  * @return
  */
-template<typename Iterator, typename T>
-T parallelAccumulate(Iterator first, Iterator last, T init) {
-    unsigned long const length = std::distance(first, last);
+template<typename Iterator, typename T, typename ReduceBlock, typename Combine>
+T parallelReduce(Iterator first, Iterator last, T init, ReduceBlock reduceBlock, Combine combine, thread_pool &pool) {
+    using ValueType = typename std::iterator_traits<Iterator>::value_type;
+    std::size_t const length = std::distance(first, last);
 
     if (!length) {
         return init;
     }
-    // select necessary number of threads to handle the parallel execution
-    unsigned long const minPerThread = 25;
-    unsigned long const maxThreads = (length + minPerThread - 1) / minPerThread;
-
-    unsigned long const hardwareThreads = std::thread::hardware_concurrency();
-    unsigned long const numThreads = std::min(
-            hardwareThreads != 0 ? hardwareThreads : 2, maxThreads
-    );
-
-    unsigned long const blockSize = length / numThreads;
-
-    std::vector<T> results(numThreads);
-    std::vector<std::thread> threads(numThreads - 1); // need one less because of the main thread that will
-    // handle the remaining elements
-
-    Iterator blockStart = first;
-    for (unsigned long i = 0; i < (numThreads - 1); ++i) {
-        Iterator blockEnd = blockStart;
-        std::advance(blockEnd, blockSize);
-        threads[i] = std::thread(
-                AccumulateBlock<Iterator, T>(),
-                blockStart, blockEnd, std::ref(results[i]) // !!pass the last parameter to the functor as reference to avoid copying!
-        );
-        blockStart = blockEnd;
+    std::size_t const numBlocks = block_count(length, min_elements_per_block<ValueType>(),
+                                                   max_elements_per_block<ValueType>(), pool);
+    if (numBlocks == 1) {
+        return combine(init, reduceBlock(first, last));
     }
 
-    AccumulateBlock<Iterator, T>()(blockStart, last, results[numThreads - 1]);
+    std::vector<padded<T>> partials(numBlocks, padded<T>{init});
+    run_blocks(first, length, numBlocks, [&partials, &reduceBlock](std::size_t block, Iterator blockFirst,
+                                                                   Iterator blockLast) {
+        // the block is reduced into a temporary, so the partial is written only once
+        partials[block].value = reduceBlock(blockFirst, blockLast);
+    }, pool);
 
-    for (auto &t : threads) {
-        t.join();
+    T result = init;
+    for (auto &partial : partials) {
+        result = combine(result, partial.value);
     }
+    return result;
+}
+
+/**
+ * Parallel accumulate algorithm on top of parallelReduce. Contiguous ranges of floats
+ * and doubles are summed with the SIMD kernels (see AccumulateBlock).
+ */
+template<typename Iterator, typename T>
+T parallelAccumulate(Iterator first, Iterator last, T init, thread_pool &pool) {
+    return parallelReduce(first, last, init, [](Iterator blockFirst, Iterator blockLast) {
+        T result = T();
+        AccumulateBlock<Iterator, T>()(blockFirst, blockLast, result);
+        return result;
+    }, [](const T &a, const T &b) { return a + b; }, pool);
+}
 
-    return std::accumulate(results.begin(), results.end(), init);
+template<typename Iterator, typename T>
+T parallelAccumulate(Iterator first, Iterator last, T init) {
+    return parallelAccumulate(first, last, init, default_thread_pool());
+}
+
+/**
+ * Smallest element of a non-empty range.
+ */
+template<typename Iterator>
+typename std::iterator_traits<Iterator>::value_type
+parallelMinValue(Iterator first, Iterator last, thread_pool &pool = default_thread_pool()) {
+    using T = typename std::iterator_traits<Iterator>::value_type;
+    return parallelReduce(first, last, *first, [](Iterator blockFirst, Iterator blockLast) {
+        if constexpr (usesSimdKernels<Iterator, T>) {
+            return simd::min(std::addressof(*blockFirst), std::distance(blockFirst, blockLast));
+        } else {
+            return *std::min_element(blockFirst, blockLast);
+        }
+    }, [](const T &a, const T &b) { return std::min(a, b); }, pool);
+}
+
+/**
+ * Largest element of a non-empty range.
+ */
+template<typename Iterator>
+typename std::iterator_traits<Iterator>::value_type
+parallelMaxValue(Iterator first, Iterator last, thread_pool &pool = default_thread_pool()) {
+    using T = typename std::iterator_traits<Iterator>::value_type;
+    return parallelReduce(first, last, *first, [](Iterator blockFirst, Iterator blockLast) {
+        if constexpr (usesSimdKernels<Iterator, T>) {
+            return simd::max(std::addressof(*blockFirst), std::distance(blockFirst, blockLast));
+        } else {
+            return *std::max_element(blockFirst, blockLast);
+        }
+    }, [](const T &a, const T &b) { return std::max(a, b); }, pool);
+}
+
+/**
+ * Parallel std::inner_product: init + sum of first1[i] * first2[i]. Contiguous ranges of
+ * floats and doubles use the SIMD dot product kernel.
+ */
+template<typename Iterator1, typename Iterator2, typename T>
+T parallelInnerProduct(Iterator1 first1, Iterator1 last1, Iterator2 first2, T init,
+                       thread_pool &pool = default_thread_pool()) {
+    return parallelReduce(first1, last1, init, [first1, first2](Iterator1 blockFirst, Iterator1 blockLast) {
+        const auto offset = std::distance(first1, blockFirst);
+        const Iterator2 blockFirst2 = std::next(first2, offset);
+        if constexpr (usesSimdKernels<Iterator1, T> && usesSimdKernels<Iterator2, T>) {
+            return simd::dot(std::addressof(*blockFirst), std::addressof(*blockFirst2),
+                             std::distance(blockFirst, blockLast));
+        } else {
+            return std::inner_product(blockFirst, blockLast, blockFirst2, T());
+        }
+    }, [](const T &a, const T &b) { return a + b; }, pool);
 }
 
 
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "thread"
+#include "utility"
+#include "vector"
+
+/**
+ * Wrapper class over std::thread that supports standard thread operations
+ * but joins the thread it owns in its destructor. It also supports move semantics.
+ */
+class JoiningThread {
+    std::thread t;
+public:
+    JoiningThread() noexcept = default;
+
+    template<class Callable, typename ... Args>
+    explicit JoiningThread(Callable &&func, Args &&... args) :
+            t(std::forward<Callable>(func), std::forward<Args>(args)...) {}
+
+    explicit JoiningThread(std::thread t_) noexcept: t(std::move(t_)) {}
+
+    JoiningThread(JoiningThread &&other) noexcept: t(std::move(other.t)) {}
+
+    JoiningThread &operator=(JoiningThread &&other) noexcept {
+        if (joinable()) {
+            join();
+        }
+        t = std::move(other.t);
+        return *this;
+    }
+
+    JoiningThread &operator=(std::thread other) noexcept {
+        if (joinable()) {
+            join();
+        }
+        t = std::move(other);
+        return *this;
+    }
+
+    ~JoiningThread() noexcept {
+        if (joinable()) {
+            join();
+        }
+    }
+
+    void swap(JoiningThread &other) noexcept {
+        t.swap(other.t);
+    }
+
+    std::thread::id get_id() const noexcept {
+        return t.get_id();
+    }
+
+    bool joinable() {
+        return t.joinable();
+    }
+
+    void join() {
+        t.join();
+    }
+
+    void detach() {
+        t.detach();
+    }
+
+    std::thread &asThread() noexcept {
+        return t;
+    }
+
+    const std::thread &asThread() const noexcept {
+        return t;
+    }
+};
+
+/**
+ * RAII guard that joins all joinable threads of a vector when it goes out of scope, e.g. when
+ * an exception leaves the function that started them. Without it the vector would destroy
+ * joinable std::thread objects, which calls std::terminate. A std::vector<JoiningThread> does the
+ * same for the threads it owns; the guard is for code that has to keep plain std::thread objects.
+ */
+class join_threads {
+    std::vector<std::thread> &threads;
+public:
+    explicit join_threads(std::vector<std::thread> &threads_) : threads(threads_) {}
+
+    ~join_threads() {
+        for (auto &t : threads) {
+            if (t.joinable()) {
+                t.join();
+            }
+        }
+    }
+
+    join_threads(const join_threads &) = delete;
+
+    join_threads &operator=(const join_threads &) = delete;
+};
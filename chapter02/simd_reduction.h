@@ -0,0 +1,252 @@
+#pragma once
+
+#include "cstddef"
+#include "cstring"
+#include "type_traits"
+
+/**
+ * Reduction kernels (sum, min, max and dot product) over contiguous arrays of float and double.
+ *
+ * std::accumulate over floats adds one element after another into a single variable. The compiler
+ * may not reorder these additions (floating point addition is not associative), so the loop
+ * is bound by the latency of one addition per element. These kernels instead keep several
+ * independent vector accumulators, each of which sums every n-th group of lanes, and only
+ * combine them at the end. The result can therefore differ from std::accumulate in the last bits.
+ *
+ * Vectors are written with the GCC/Clang vector extensions, so the same kernel is compiled for
+ * 16 byte vectors (SSE2 on x86-64, NEON on ARM) and, on x86, once more for 32 byte vectors
+ * with AVX2 enabled, which is selected at runtime if the CPU supports it. Other compilers get
+ * a portable scalar kernel with multiple accumulators.
+ */
+namespace simd {
+    template<typename T>
+    constexpr bool isSupported = std::is_same_v<T, float> || std::is_same_v<T, double>;
+
+    enum class Reduction {
+        sum, min, max
+    };
+
+    namespace detail {
+        // independent accumulators per kernel: enough to hide the latency of vector addition
+        constexpr std::size_t accumulators = 4;
+
+        template<Reduction R, typename T>
+        T combine(T a, T b) {
+            if constexpr (R == Reduction::sum) {
+                return a + b;
+            } else if constexpr (R == Reduction::min) {
+                return b < a ? b : a;
+            } else {
+                return a < b ? b : a;
+            }
+        }
+
+        template<Reduction R, typename T>
+        T reducePortable(const T *data, std::size_t n) {
+            std::size_t i = 0;
+            T acc[accumulators];
+            if (n < accumulators) {
+                T result = data[0];
+                for (i = 1; i < n; ++i) {
+                    result = combine<R>(result, data[i]);
+                }
+                return result;
+            }
+            for (; i < accumulators; ++i) {
+                acc[i] = data[i];
+            }
+            for (; i + accumulators <= n; i += accumulators) {
+                for (std::size_t k = 0; k < accumulators; ++k) {
+                    acc[k] = combine<R>(acc[k], data[i + k]);
+                }
+            }
+            T result = combine<R>(combine<R>(acc[0], acc[1]), combine<R>(acc[2], acc[3]));
+            for (; i < n; ++i) {
+                result = combine<R>(result, data[i]);
+            }
+            return result;
+        }
+
+        template<typename T>
+        T dotPortable(const T *a, const T *b, std::size_t n) {
+            T acc[accumulators] = {};
+            std::size_t i = 0;
+            for (; i + accumulators <= n; i += accumulators) {
+                for (std::size_t k = 0; k < accumulators; ++k) {
+                    acc[k] += a[i + k] * b[i + k];
+                }
+            }
+            T result = (acc[0] + acc[1]) + (acc[2] + acc[3]);
+            for (; i < n; ++i) {
+                result += a[i] * b[i];
+            }
+            return result;
+        }
+
+#if defined(__GNUC__)
+#define SIMD_REDUCTION_HAS_VECTORS 1
+        /*
+         * The kernels are always inlined into the ISA specific wrappers below, which is what
+         * compiles them with the wrapper's instruction set. For the same reason they don't call
+         * helper functions that take vectors: those would be compiled for the default instruction set.
+         */
+        template<Reduction R, typename T, std::size_t VectorBytes>
+        [[gnu::always_inline]] inline T reduceVector(const T *data, std::size_t n) {
+            typedef T Vector __attribute__((vector_size(VectorBytes)));
+            constexpr std::size_t lanes = VectorBytes / sizeof(T);
+            constexpr std::size_t step = lanes * accumulators;
+            if (n < step) {
+                return reducePortable<R>(data, n);
+            }
+            Vector acc[accumulators];
+            std::size_t i = 0;
+            if constexpr (R == Reduction::sum) {
+                for (auto &a : acc) {
+                    a = Vector{};
+                }
+            } else {
+                // min and max have no identity that works for every value, start with the first elements
+                std::memcpy(acc, data, sizeof(acc));
+                i = step;
+            }
+            for (; i + step <= n; i += step) {
+                for (std::size_t k = 0; k < accumulators; ++k) {
+                    Vector v;
+                    std::memcpy(&v, data + i + k * lanes, sizeof(v));
+                    if constexpr (R == Reduction::sum) {
+                        acc[k] += v;
+                    } else if constexpr (R == Reduction::min) {
+                        acc[k] = v < acc[k] ? v : acc[k];
+                    } else {
+                        acc[k] = acc[k] < v ? v : acc[k];
+                    }
+                }
+            }
+            T lanesResult[step];
+            std::memcpy(lanesResult, acc, sizeof(acc));
+            T result = lanesResult[0];
+            for (std::size_t l = 1; l < step; ++l) {
+                result = combine<R>(result, lanesResult[l]);
+            }
+            for (; i < n; ++i) {
+                result = combine<R>(result, data[i]);
+            }
+            return result;
+        }
+
+        template<typename T, std::size_t VectorBytes>
+        [[gnu::always_inline]] inline T dotVector(const T *a, const T *b, std::size_t n) {
+            typedef T Vector __attribute__((vector_size(VectorBytes)));
+            constexpr std::size_t lanes = VectorBytes / sizeof(T);
+            constexpr std::size_t step = lanes * accumulators;
+            Vector acc[accumulators];
+            for (auto &v : acc) {
+                v = Vector{};
+            }
+            std::size_t i = 0;
+            for (; i + step <= n; i += step) {
+                for (std::size_t k = 0; k < accumulators; ++k) {
+                    Vector x, y;
+                    std::memcpy(&x, a + i + k * lanes, sizeof(x));
+                    std::memcpy(&y, b + i + k * lanes, sizeof(y));
+                    acc[k] += x * y;
+                }
+            }
+            T lanesResult[step];
+            std::memcpy(lanesResult, acc, sizeof(acc));
+            T result = T();
+            for (std::size_t l = 0; l < step; ++l) {
+                result += lanesResult[l];
+            }
+            for (; i < n; ++i) {
+                result += a[i] * b[i];
+            }
+            return result;
+        }
+
+        template<Reduction R, typename T>
+        T reduce16(const T *data, std::size_t n) {
+            return reduceVector<R, T, 16>(data, n);
+        }
+
+        template<typename T>
+        T dot16(const T *a, const T *b, std::size_t n) {
+            return dotVector<T, 16>(a, b, n);
+        }
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SIMD_REDUCTION_HAS_AVX2 1
+        template<Reduction R, typename T>
+        [[gnu::target("avx2")]] T reduceAvx2(const T *data, std::size_t n) {
+            return reduceVector<R, T, 32>(data, n);
+        }
+
+        template<typename T>
+        [[gnu::target("avx2")]] T dotAvx2(const T *a, const T *b, std::size_t n) {
+            return dotVector<T, 32>(a, b, n);
+        }
+
+        inline bool cpuHasAvx2() {
+            static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+            return hasAvx2;
+        }
+#endif
+    }
+
+    /**
+     * Reduces data[0, n) with [R]. For min and max n must not be 0.
+     */
+    template<Reduction R, typename T>
+    T reduce(const T *data, std::size_t n) {
+        static_assert(isSupported<T>, "SIMD kernels are available only for float and double");
+        if constexpr (R == Reduction::sum) {
+            if (n == 0) {
+                return T();
+            }
+        }
+#if defined(SIMD_REDUCTION_HAS_AVX2)
+        if (detail::cpuHasAvx2()) {
+            return detail::reduceAvx2<R>(data, n);
+        }
+#endif
+#if defined(SIMD_REDUCTION_HAS_VECTORS)
+        return detail::reduce16<R>(data, n);
+#else
+        return detail::reducePortable<R>(data, n);
+#endif
+    }
+
+    template<typename T>
+    T sum(const T *data, std::size_t n) {
+        return reduce<Reduction::sum>(data, n);
+    }
+
+    template<typename T>
+    T min(const T *data, std::size_t n) {
+        return reduce<Reduction::min>(data, n);
+    }
+
+    template<typename T>
+    T max(const T *data, std::size_t n) {
+        return reduce<Reduction::max>(data, n);
+    }
+
+    /**
+     * Sum of a[i] * b[i] for i in [0, n).
+     */
+    template<typename T>
+    T dot(const T *a, const T *b, std::size_t n) {
+        static_assert(isSupported<T>, "SIMD kernels are available only for float and double");
+#if defined(SIMD_REDUCTION_HAS_AVX2)
+        if (detail::cpuHasAvx2()) {
+            return detail::dotAvx2(a, b, n);
+        }
+#endif
+#if defined(SIMD_REDUCTION_HAS_VECTORS)
+        return detail::dot16(a, b, n);
+#else
+        return detail::dotPortable(a, b, n);
+#endif
+    }
+}
@@ -2,6 +2,22 @@
 #include "memory"
 #include "map"
 #include "shared_mutex"
+#include "algorithm"
+#include "atomic"
+#include "chrono"
+#include "cstdint"
+#include "functional"
+#include "iostream"
+#include "future"
+#include "stdexcept"
+#include "string"
+#include "string_view"
+#include "thread"
+#include "unordered_map"
+#include "utility"
+#include "vector"
+#include "chapter02/joining_thread.h"
+#include "chapter08/cache_line.h"
 
 class SomeBigObject {
 };
@@ -87,11 +103,134 @@ void undefinedBehaviourWithDoubleCheckLocking() {
 
 // Protecting a data structure with std::shared_mutex
 class DnsEntry {
+public:
+    std::string address;
 };
 
+/**
+ * Besides plain lookups, the cache can load missing entries itself (getOrLoad). A cold or expired
+ * domain is loaded by exactly one thread: the first thread that misses installs a shared future in
+ * the cache and runs the loader, and the threads that miss while the load runs wait on that future
+ * instead of resolving the same domain again (single flight).
+ *
+ * A loaded entry expires after its TTL. A hit in the last quarter of the TTL starts a refresh in the
+ * background and returns the current entry, so a popular domain is reloaded before it expires and
+ * its readers don't wait for a load.
+ */
 class DnsCache {
-    std::map<std::string, DnsEntry> entries;
+public:
+    using Clock = std::chrono::steady_clock;
+    using Loader = std::function<DnsEntry(const std::string &)>;
+
+private:
+    struct CachedEntry {
+        std::shared_future<DnsEntry> entry;
+        // time_point::max() for entries that never expire, and for entries that are being loaded
+        Clock::time_point expiresAt;
+        Clock::time_point refreshAt;
+        // identifies the entry, so a load that finishes after the entry has been replaced leaves it alone
+        std::uint64_t version;
+        bool refreshing;
+    };
+
+    std::map<std::string, CachedEntry> entries;
     mutable std::shared_mutex entryMutex;
+    std::uint64_t nextVersion = 0;
+    // declared last, so it is destroyed first: destroying the futures waits for the running refreshes,
+    // which still use the members above
+    std::vector<std::future<void>> refreshes;
+
+    static std::shared_future<DnsEntry> readyEntry(const DnsEntry &dnsDetails) {
+        std::promise<DnsEntry> promise;
+        promise.set_value(dnsDetails);
+        return promise.get_future().share();
+    }
+
+    static void setExpiry(CachedEntry &cachedEntry, Clock::duration ttl) {
+        const auto now = Clock::now();
+        // a TTL that reaches past time_point::max() would overflow, so such an entry never expires
+        if (ttl >= Clock::time_point::max() - now) {
+            cachedEntry.expiresAt = Clock::time_point::max();
+            cachedEntry.refreshAt = Clock::time_point::max();
+            return;
+        }
+        cachedEntry.expiresAt = now + ttl;
+        cachedEntry.refreshAt = now + (ttl - ttl / 4);
+    }
+
+    /**
+     * Runs the loader for an entry installed by getOrLoad and publishes the result to the threads
+     * waiting on [promise]. A failed load is removed from the cache, so the next miss tries again.
+     */
+    DnsEntry load(const std::string &domain, const Loader &loader, Clock::duration ttl,
+                  std::promise<DnsEntry> &promise, std::uint64_t version) {
+        DnsEntry dnsDetails;
+        try {
+            dnsDetails = loader(domain);
+        } catch (...) {
+            {
+                std::lock_guard<std::shared_mutex> lk(entryMutex);
+                const auto it = entries.find(domain);
+                if (it != entries.end() && it->second.version == version) {
+                    entries.erase(it);
+                }
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+        std::lock_guard<std::shared_mutex> lk(entryMutex);
+        const auto it = entries.find(domain);
+        if (it != entries.end() && it->second.version == version) {
+            setExpiry(it->second, ttl);
+        }
+        promise.set_value(dnsDetails);
+        return dnsDetails;
+    }
+
+    /**
+     * Runs in the background. The current entry stays in use until the new one is loaded;
+     * if the load fails, it stays until it expires.
+     */
+    void refresh(const std::string &domain, const Loader &loader, Clock::duration ttl, std::uint64_t version) {
+        std::shared_future<DnsEntry> refreshed;
+        try {
+            refreshed = readyEntry(loader(domain));
+        } catch (...) {
+        }
+        std::lock_guard<std::shared_mutex> lk(entryMutex);
+        const auto it = entries.find(domain);
+        if (it == entries.end() || it->second.version != version) {
+            return;
+        }
+        if (refreshed.valid()) {
+            it->second.entry = refreshed;
+            setExpiry(it->second, ttl);
+        }
+        it->second.refreshing = false;
+    }
+
+    /**
+     * Must be called with entryMutex locked exclusively. If the refresh can't be started, the entry is
+     * left as it is and the next hit in the last quarter of its TTL tries again.
+     */
+    void startRefresh(const std::string &domain, const Loader &loader, Clock::duration ttl, CachedEntry &cachedEntry) {
+        refreshes.erase(std::remove_if(refreshes.begin(), refreshes.end(), [](const std::future<void> &refresh) {
+            return refresh.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+        }), refreshes.end());
+        const std::uint64_t version = cachedEntry.version;
+        try {
+            // reserved before the refresh starts: if push_back threw, destroying the future would wait for
+            // the refresh, which waits for entryMutex, which this thread holds
+            refreshes.reserve(refreshes.size() + 1);
+            refreshes.push_back(std::async(std::launch::async, [this, domain, loader, ttl, version] {
+                refresh(domain, loader, ttl, version);
+            }));
+        } catch (...) {
+            // e.g. no thread could be started; the current entry is still valid, so the caller gets it anyway
+            return;
+        }
+        cachedEntry.refreshing = true;
+    }
 
 public:
     DnsEntry findEntry(const std::string &domain) const {
@@ -100,17 +239,181 @@ public:
         // will have to wait
         std::shared_lock<std::shared_mutex> lk(entryMutex);
         const auto it = entries.find(domain);
-        return (it == entries.end()) ? DnsEntry{} : it->second;
+        // an entry that is still being loaded counts as a miss, findEntry never waits
+        if (it == entries.end() || Clock::now() >= it->second.expiresAt ||
+            it->second.entry.wait_for(std::chrono::seconds(0)) != std::future_status::ready) {
+            return DnsEntry{};
+        }
+        return it->second.entry.get();
+    }
+
+    /**
+     * Returns the entry for [domain], calling loader(domain) if it is missing or expired. Only one thread
+     * loads a given domain at a time, the others wait for its result (or its exception).
+     * @param ttl how long a loaded entry is used; it is refreshed in the background in the last quarter.
+     */
+    DnsEntry getOrLoad(const std::string &domain, const Loader &loader, Clock::duration ttl) {
+        std::shared_future<DnsEntry> cached;
+        {
+            std::shared_lock<std::shared_mutex> lk(entryMutex);
+            const auto it = entries.find(domain);
+            const auto now = Clock::now();
+            if (it != entries.end() && now < it->second.expiresAt &&
+                (now < it->second.refreshAt || it->second.refreshing)) {
+                cached = it->second.entry;
+            }
+        }
+        if (cached.valid()) {
+            // wait without holding the lock, the loading thread needs it to publish the entry
+            return cached.get();
+        }
+
+        std::promise<DnsEntry> promise;
+        std::uint64_t version = 0;
+        {
+            std::lock_guard<std::shared_mutex> lk(entryMutex);
+            const auto it = entries.find(domain);
+            if (it != entries.end() && Clock::now() < it->second.expiresAt) {
+                // another thread has loaded the entry in the meantime, or it only needs a refresh
+                if (Clock::now() >= it->second.refreshAt && !it->second.refreshing) {
+                    startRefresh(domain, loader, ttl, it->second);
+                }
+                cached = it->second.entry;
+            } else {
+                version = nextVersion++;
+                entries[domain] = CachedEntry{promise.get_future().share(), Clock::time_point::max(),
+                                              Clock::time_point::max(), version, false};
+            }
+        }
+        if (cached.valid()) {
+            return cached.get();
+        }
+        return load(domain, loader, ttl, promise, version);
     }
 
     void updateOrAddEntry(const std::string &domain, const DnsEntry &dnsDetails) {
         // writer lock. Only one thread is operating on data. If any other thread holds shared lock
         // this thread waits for all of them to relinquish their locks.
         std::lock_guard<std::shared_mutex> lk(entryMutex);
-        entries[domain] = dnsDetails;
+        entries[domain] = CachedEntry{readyEntry(dnsDetails), Clock::time_point::max(), Clock::time_point::max(),
+                                      nextVersion++, false};
+    }
+};
+
+/**
+ * Read path of DnsCache for many cores: the domains are spread over shards, each with its own
+ * shared_mutex and hash table, so concurrent readers of different domains don't bounce the same
+ * reader count between cores, and a lookup costs one hash instead of an O(log n) walk of string
+ * comparisons.
+ *
+ * The hash of a domain is computed once per call, from a string_view, and is used both to choose
+ * the shard and as the key of the shard's table; the domain strings are compared only when the hashes
+ * match. Looking up a domain never constructs a std::string.
+ */
+class ShardedDnsCache {
+    // the keys are hashes already
+    struct IdentityHash {
+        std::size_t operator()(std::size_t hash) const {
+            return hash;
+        }
+    };
+
+    struct alignas(cache_line_size) Shard {
+        std::unordered_multimap<std::size_t, std::pair<std::string, DnsEntry>, IdentityHash> entries;
+        mutable std::shared_mutex entryMutex;
+    };
+
+    std::vector<Shard> shards;
+
+    const Shard &shardFor(std::size_t hash) const {
+        // the shard's table uses the low bits for its buckets, so choose the shard with higher ones
+        return shards[(hash >> 16) % shards.size()];
+    }
+
+    Shard &shardFor(std::size_t hash) {
+        return shards[(hash >> 16) % shards.size()];
+    }
+
+public:
+    explicit ShardedDnsCache(unsigned shardCount = 16) : shards(shardCount ? shardCount : 1) {}
+
+    DnsEntry findEntry(std::string_view domain) const {
+        const std::size_t hash = std::hash<std::string_view>()(domain);
+        const Shard &shard = shardFor(hash);
+        std::shared_lock<std::shared_mutex> lk(shard.entryMutex);
+        const auto range = shard.entries.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.first == domain) {
+                return it->second.second;
+            }
+        }
+        return DnsEntry{};
+    }
+
+    void updateOrAddEntry(std::string_view domain, const DnsEntry &dnsDetails) {
+        const std::size_t hash = std::hash<std::string_view>()(domain);
+        Shard &shard = shardFor(hash);
+        std::lock_guard<std::shared_mutex> lk(shard.entryMutex);
+        const auto range = shard.entries.equal_range(hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second.first == domain) {
+                it->second.second = dnsDetails;
+                return;
+            }
+        }
+        shard.entries.emplace(hash, std::make_pair(std::string(domain), dnsDetails));
     }
 };
 
+/**
+ * [numThreads] threads call getOrLoad for the same cold domain at once, with a slow loader.
+ * @return true if the loader ran once and every thread got its entry; with a throwing loader,
+ * if it ran once and its exception reached every thread.
+ */
+bool dnsCacheRound(bool loaderThrows, unsigned numThreads = 8) {
+    DnsCache cache;
+    std::atomic<unsigned> loads(0);
+    std::atomic<unsigned> ready(0);
+    std::atomic<unsigned> succeeded(0);
+    std::atomic<unsigned> failed(0);
+    const DnsCache::Loader loader = [&loads, loaderThrows](const std::string &) {
+        ++loads;
+        // long enough for all the threads to miss while the load runs
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (loaderThrows) {
+            throw std::runtime_error("no such domain");
+        }
+        return DnsEntry{"192.0.2.1"};
+    };
+    {
+        std::vector<std::thread> threads;
+        join_threads joiner(threads);
+        for (unsigned t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&, numThreads] {
+                // start all the calls together
+                ++ready;
+                while (ready.load() < numThreads) {
+                    std::this_thread::yield();
+                }
+                try {
+                    succeeded += cache.getOrLoad("example.com", loader, std::chrono::hours(1)).address == "192.0.2.1";
+                } catch (const std::runtime_error &) {
+                    ++failed;
+                }
+            });
+        }
+    }
+    return loads.load() == 1 && (loaderThrows ? failed.load() : succeeded.load()) == numThreads;
+}
+
+int mainChapter3() {
+    const bool loadPassed = dnsCacheRound(false);
+    std::cout << "DnsCache::getOrLoad: " << (loadPassed ? "passed" : "FAILED") << '\n';
+    const bool failedLoadPassed = dnsCacheRound(true);
+    std::cout << "DnsCache::getOrLoad with a failing loader: " << (failedLoadPassed ? "passed" : "FAILED") << '\n';
+    return loadPassed && failedLoadPassed ? 0 : 1;
+}
+
 
 
 
@@ -30,7 +30,9 @@ namespace messaging {
         }
 
         bool dispatch(const std::shared_ptr<message_base> &msg) {
-            if (dynamic_cast<wrapped_message<close_queue> *>(msg.get())) {
+            // an empty message means that the queue has been closed and drained,
+            // which is handled the same way as the close_queue message
+            if (!msg || dynamic_cast<wrapped_message<close_queue> *>(msg.get())) {
                 throw close_queue();
             }
             return false;
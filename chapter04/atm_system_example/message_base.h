@@ -4,6 +4,7 @@
 #include "condition_variable"
 #include "queue"
 #include "memory"
+#include "chrono"
 
 namespace messaging {
     struct message_base {
@@ -24,6 +25,20 @@ namespace messaging {
          * Internal queue stores pointers to message_base
          */
         std::queue<std::shared_ptr<message_base>> q;
+        /**
+         * Once the queue is closed, waiting threads are woken up and wait_and_pop
+         * returns an empty pointer instead of blocking when there are no messages.
+         */
+        bool closed = false;
+
+        std::shared_ptr<message_base> pop_front() {
+            if (q.empty()) {
+                return std::shared_ptr<message_base>();
+            }
+            auto res = q.front();
+            q.pop();
+            return res;
+        }
 
     public:
         template<class T>
@@ -34,13 +49,41 @@ namespace messaging {
             c.notify_all();
         }
 
+        /**
+         * @return next message or an empty pointer if the queue has been closed and there
+         * are no more messages.
+         */
         std::shared_ptr<message_base> wait_and_pop() {
             std::unique_lock lk(m);
             // block until queue is not empty, in other words, wait while the queue is empty
-            c.wait(lk, [&] { return !q.empty(); });
-            auto res = q.front();
-            q.pop();
-            return res;
+            c.wait(lk, [&] { return !q.empty() || closed; });
+            return pop_front();
+        }
+
+        /**
+         * @return next message or an empty pointer if [deadline] has passed or the queue
+         * has been closed and there are no more messages.
+         */
+        template<typename Clock, typename Duration>
+        std::shared_ptr<message_base> wait_and_pop_until(const std::chrono::time_point<Clock, Duration> &deadline) {
+            std::unique_lock lk(m);
+            c.wait_until(lk, deadline, [&] { return !q.empty() || closed; });
+            return pop_front();
+        }
+
+        template<typename Rep, typename Period>
+        std::shared_ptr<message_base> wait_and_pop_for(const std::chrono::duration<Rep, Period> &timeout) {
+            return wait_and_pop_until(std::chrono::steady_clock::now() + timeout);
+        }
+
+        /**
+         * Wakes up all waiting threads. Messages that are already in the queue are still
+         * delivered, after that wait_and_pop returns an empty pointer instead of blocking.
+         */
+        void close() {
+            std::lock_guard lk(m);
+            closed = true;
+            c.notify_all();
         }
     };
 }
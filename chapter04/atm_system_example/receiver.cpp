@@ -4,4 +4,8 @@ namespace messaging {
     dispatcher receiver::wait() {
         return dispatcher(&q);
     }
+
+    void receiver::close() {
+        q.close();
+    }
 }
\ No newline at end of file
@@ -14,5 +14,9 @@ namespace messaging {
         }
         // waiting for a queue creates a dispatcher
         dispatcher wait();
+
+        // closing the queue makes the waiting dispatcher throw close_queue once
+        // the pending messages are handled, without sending a close_queue message
+        void close();
     };
 }
@@ -0,0 +1,372 @@
+#pragma once
+
+#include "atomic"
+#include "chrono"
+#include "cstddef"
+#include "memory"
+#include "mutex"
+#include "new"
+#include "optional"
+#include "type_traits"
+#include "utility"
+#include "condition_variable"
+#include "chapter08/cache_line.h"
+
+/**
+ * Bounded multi producer / multi consumer queue built on top of a ring buffer
+ * (Dmitry Vyukov's algorithm). It supports the same operations as ThreadSafeQueue,
+ * but the storage for all elements is allocated once in the constructor, so
+ * steady-state Push/Pop never touch the heap.
+ *
+ * Every slot of the ring carries its own sequence number:
+ *  - sequence == position      means the slot is free and a producer that claimed
+ *                              [position] may write into it.
+ *  - sequence == position + 1  means the slot holds a value and a consumer that claimed
+ *                              [position] may read from it.
+ * Producers claim a position by CAS on enqueuePos, consumers by CAS on dequeuePos,
+ * so producers and consumers don't serialize on a common lock. After reading a value
+ * the consumer sets sequence to position + capacity, which releases the slot for the
+ * producer that will arrive there on the next lap of the ring.
+ *
+ * The mutex and condition variables are used only to put threads to sleep in the
+ * blocking Push and WaitAndPop operations. A thread that goes to sleep first registers
+ * itself in a waiters counter, so non-blocking operations only pay for a lock when
+ * somebody actually waits.
+ *
+ * Close() wakes up all sleeping threads: blocked producers give up, and consumers
+ * drain what is left in the queue and then return an empty result instead of blocking.
+ *
+ * A claimed slot must always be handed on, or every later thread arriving at it would wait forever,
+ * so nothing may throw between claiming a slot and advancing its sequence: values are only moved
+ * in and out of the slots, and T must be nothrow move constructible.
+ *
+ * @tparam T type of values stored in the queue.
+ */
+template<typename T>
+class BoundedThreadSafeQueue {
+private:
+    static_assert(std::is_nothrow_move_constructible_v<T>,
+                  "BoundedThreadSafeQueue needs a nothrow move constructor to keep its slots consistent");
+
+
+    struct alignas(cache_line_size) Cell {
+        std::atomic<std::size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *Value() {
+            return std::launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    const std::size_t capacity;
+    const std::size_t mask;
+    std::unique_ptr<Cell[]> buffer;
+
+    // producers and consumers hammer different positions, so keep them on different cache lines
+    alignas(cache_line_size) std::atomic<std::size_t> enqueuePos;
+    alignas(cache_line_size) std::atomic<std::size_t> dequeuePos;
+
+    alignas(cache_line_size) std::mutex waitMutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+    std::atomic<unsigned> waitingConsumers;
+    std::atomic<unsigned> waitingProducers;
+    std::atomic<bool> closed;
+
+    static std::size_t RoundUpToPowerOfTwo(std::size_t value) {
+        std::size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    /**
+     * Claims a free slot and moves [newValue] into it.
+     * @return false if the queue is full.
+     */
+    bool TryEnqueue(T &&newValue) {
+        std::size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = buffer[pos & mask];
+            const std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff =
+                    static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0) {
+                // the slot is free, try to claim it. On failure pos is reloaded.
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    new(cell.storage) T(std::move(newValue));
+                    // publish the value to the consumer of this position
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // the slot still holds a value from the previous lap: the queue is full
+                return false;
+            } else {
+                // another producer claimed this position, catch up
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Claims an occupied slot and moves the value out of it into [value]. Moving into a std::optional<T>
+     * can't throw, and the pop operations don't need T to be default constructible. The value is moved
+     * on to the caller's variable (see MoveOut) only after the slot has been released.
+     * @return false if the queue is empty.
+     */
+    bool TryDequeue(std::optional<T> &value) {
+        std::size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell &cell = buffer[pos & mask];
+            const std::size_t seq = cell.sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff =
+                    static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    T *stored = cell.Value();
+                    value.emplace(std::move(*stored));
+                    stored->~T();
+                    // hand the slot over to the producer of the next lap
+                    cell.sequence.store(pos + capacity, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                // the producer of this position hasn't published yet: the queue is empty
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /**
+     * Wakes a sleeping thread if there is one. The seq_cst fence pairs with the one in
+     * the waiting thread: either the waiter sees the slot we have just published, or we
+     * see the waiter registered in the counter.
+     */
+    void WakeOne(std::atomic<unsigned> &waiters, std::condition_variable &cond) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiters.load(std::memory_order_relaxed) != 0) {
+            // taking the lock guarantees the waiter is either before its check or already asleep
+            { std::lock_guard lk(waitMutex); }
+            cond.notify_one();
+        }
+    }
+
+    /**
+     * Sleeps until [op] succeeds or the queue is closed.
+     * @return result of the last attempt of [op].
+     */
+    template<typename Operation>
+    bool WaitFor(std::atomic<unsigned> &waiters, std::condition_variable &cond, Operation op) {
+        bool done = false;
+        std::unique_lock lk(waitMutex);
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait(lk, [&] { return (done = op()) || closed.load(std::memory_order_relaxed); });
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return done;
+    }
+
+    /**
+     * Same as WaitFor, but gives up at [deadline].
+     */
+    template<typename Clock, typename Duration, typename Operation>
+    bool WaitUntil(std::atomic<unsigned> &waiters, std::condition_variable &cond,
+                   const std::chrono::time_point<Clock, Duration> &deadline, Operation op) {
+        bool done = false;
+        std::unique_lock lk(waitMutex);
+        waiters.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cond.wait_until(lk, deadline, [&] { return (done = op()) || closed.load(std::memory_order_relaxed); });
+        waiters.fetch_sub(1, std::memory_order_relaxed);
+        return done;
+    }
+
+    // the pop operations, with a std::optional<T> as the output (see TryDequeue)
+
+    bool WaitAndPopInto(std::optional<T> &value) {
+        if (!TryDequeue(value) &&
+            !WaitFor(waitingConsumers, notEmpty, [&] { return TryDequeue(value); })) {
+            return false;
+        }
+        WakeOne(waitingProducers, notFull);
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    bool WaitAndPopUntilInto(std::optional<T> &value, const std::chrono::time_point<Clock, Duration> &deadline) {
+        if (!TryDequeue(value) &&
+            !WaitUntil(waitingConsumers, notEmpty, deadline, [&] { return TryDequeue(value); })) {
+            return false;
+        }
+        WakeOne(waitingProducers, notFull);
+        return true;
+    }
+
+    bool TryPopInto(std::optional<T> &value) {
+        if (!TryDequeue(value)) {
+            return false;
+        }
+        WakeOne(waitingProducers, notFull);
+        return true;
+    }
+
+    /**
+     * Moves a popped value into the caller's variable. The assignment may throw, so it runs
+     * after the slot has been released and the producers have been woken up.
+     */
+    static bool MoveOut(std::optional<T> &popped, T &value) {
+        value = std::move(*popped);
+        return true;
+    }
+
+public:
+    /**
+     * @param requestedCapacity maximum number of elements in the queue.
+     *          It is rounded up to the next power of two.
+     */
+    explicit BoundedThreadSafeQueue(std::size_t requestedCapacity) :
+            capacity(RoundUpToPowerOfTwo(requestedCapacity < 2 ? 2 : requestedCapacity)),
+            mask(capacity - 1),
+            buffer(new Cell[capacity]),
+            enqueuePos(0),
+            dequeuePos(0),
+            waitingConsumers(0),
+            waitingProducers(0),
+            closed(false) {
+        for (std::size_t i = 0; i < capacity; ++i) {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~BoundedThreadSafeQueue() {
+        // destroy values that were pushed but never popped
+        const std::size_t last = enqueuePos.load(std::memory_order_relaxed);
+        for (std::size_t pos = dequeuePos.load(std::memory_order_relaxed); pos != last; ++pos) {
+            Cell &cell = buffer[pos & mask];
+            if (cell.sequence.load(std::memory_order_relaxed) == pos + 1) {
+                cell.Value()->~T();
+            }
+        }
+    }
+
+    BoundedThreadSafeQueue(const BoundedThreadSafeQueue &) = delete;
+
+    BoundedThreadSafeQueue &operator=(const BoundedThreadSafeQueue &) = delete;
+
+    /**
+     * Pushes [newValue] into the queue if there is free space.
+     * @return false if the queue is full.
+     */
+    bool TryPush(T newValue) {
+        if (!TryEnqueue(std::move(newValue))) {
+            return false;
+        }
+        WakeOne(waitingConsumers, notEmpty);
+        return true;
+    }
+
+    /**
+     * Pushes [newValue] into the queue, blocking while the queue is full.
+     * @return false if the queue has been closed while waiting for free space.
+     */
+    bool Push(T newValue) {
+        if (!TryEnqueue(std::move(newValue)) &&
+            !WaitFor(waitingProducers, notFull, [&] { return TryEnqueue(std::move(newValue)); })) {
+            return false;
+        }
+        WakeOne(waitingConsumers, notEmpty);
+        return true;
+    }
+
+    /**
+     * Waits for a value to become available.
+     * @return false if the queue has been closed and there is no more data.
+     */
+    bool WaitAndPop(T &value) {
+        std::optional<T> popped;
+        return WaitAndPopInto(popped) && MoveOut(popped, value);
+    }
+
+    std::shared_ptr<T> WaitAndPop() {
+        std::optional<T> value;
+        if (!WaitAndPopInto(value)) {
+            return std::shared_ptr<T>();
+        }
+        return std::make_shared<T>(std::move(*value));
+    }
+
+    /**
+     * Waits for a value until [deadline].
+     * @return false if the deadline has passed or the queue has been closed and there is no more data.
+     */
+    template<typename Clock, typename Duration>
+    bool WaitAndPopUntil(T &value, const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::optional<T> popped;
+        return WaitAndPopUntilInto(popped, deadline) && MoveOut(popped, value);
+    }
+
+    template<typename Clock, typename Duration>
+    std::shared_ptr<T> WaitAndPopUntil(const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::optional<T> value;
+        if (!WaitAndPopUntilInto(value, deadline)) {
+            return std::shared_ptr<T>();
+        }
+        return std::make_shared<T>(std::move(*value));
+    }
+
+    template<typename Rep, typename Period>
+    bool WaitAndPopFor(T &value, const std::chrono::duration<Rep, Period> &timeout) {
+        return WaitAndPopUntil(value, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> WaitAndPopFor(const std::chrono::duration<Rep, Period> &timeout) {
+        return WaitAndPopUntil(std::chrono::steady_clock::now() + timeout);
+    }
+
+    bool TryPop(T &value) {
+        std::optional<T> popped;
+        return TryPopInto(popped) && MoveOut(popped, value);
+    }
+
+    std::shared_ptr<T> TryPop() {
+        std::optional<T> value;
+        if (!TryPopInto(value)) {
+            return std::shared_ptr<T>();
+        }
+        return std::make_shared<T>(std::move(*value));
+    }
+
+    /**
+     * Wakes up all blocked producers and consumers. Non-blocking operations keep working.
+     */
+    void Close() {
+        {
+            std::lock_guard lk(waitMutex);
+            closed.store(true, std::memory_order_relaxed);
+        }
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+    bool IsClosed() const {
+        return closed.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * The result is only a snapshot: the queue may be modified by other threads
+     * by the time the caller looks at it.
+     */
+    bool empty() const {
+        return enqueuePos.load(std::memory_order_acquire) ==
+               dequeuePos.load(std::memory_order_acquire);
+    }
+
+    std::size_t Capacity() const {
+        return capacity;
+    }
+};
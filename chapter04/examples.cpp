@@ -5,6 +5,11 @@
 #include "utility"
 #include "condition_variable"
 #include "chrono"
+#include "atomic"
+#include "iostream"
+#include "vector"
+#include "chapter02/joining_thread.h"
+#include "chapter04/bounded_thread_safe_queue.h"
 
 using namespace std;
 
@@ -34,7 +39,11 @@ void guiThread() {
     }
 }
 
-thread guiBackgroundThread(guiThread);
+// started by the caller rather than at static initialization: a global thread that runs forever and is
+// never joined would terminate the whole program when it exits
+thread startGuiBackgroundThread() {
+    return thread(guiThread);
+}
 
 template<typename Func>
 future<void> postTaskForGuiThread(Func f) {
@@ -164,20 +173,80 @@ bool waitLoop() {
 //</editor-fold>
 
 
+//<editor-fold desc="Producers and consumers on a bounded queue">
+/**
+ * Two producers push 0..valuesPerProducer-1 each into a queue of capacity 4, so the ring wraps
+ * thousands of times. One consumer pops with WaitAndPop, the other with WaitAndPopFor; the queue is
+ * closed once the producers are done, which wakes up the consumers blocked on the empty queue.
+ * Then a blocked consumer and a blocked producer are woken up by Close() on their own.
+ * @return true if every value was popped exactly once (count and sum) and the blocked calls gave up on Close().
+ */
+bool boundedQueueRound(unsigned valuesPerProducer = 10000) {
+    BoundedThreadSafeQueue<int> queue(4);
+    atomic<unsigned> popped(0);
+    atomic<long> sum(0);
+    {
+        vector<thread> consumers;
+        join_threads consumersJoiner(consumers);
+        consumers.emplace_back([&queue, &popped, &sum] {
+            int value;
+            while (queue.WaitAndPop(value)) {
+                sum += value;
+                ++popped;
+            }
+        });
+        consumers.emplace_back([&queue, &popped, &sum] {
+            for (;;) {
+                if (const shared_ptr<int> value = queue.WaitAndPopFor(chrono::milliseconds(1))) {
+                    sum += *value;
+                    ++popped;
+                } else if (queue.IsClosed() && queue.empty()) {
+                    break;
+                }
+            }
+        });
+        {
+            vector<thread> producers;
+            join_threads producersJoiner(producers);
+            for (unsigned p = 0; p < 2; ++p) {
+                producers.emplace_back([&queue, valuesPerProducer] {
+                    for (unsigned i = 0; i < valuesPerProducer; ++i) {
+                        queue.Push(static_cast<int>(i));
+                    }
+                });
+            }
+        }
+        queue.Close();
+    }
+    const long expectedSum = static_cast<long>(valuesPerProducer) * (valuesPerProducer - 1);
+    bool passed = popped.load() == 2 * valuesPerProducer && sum.load() == expectedSum;
+
+    // nothing is pushed, so the deadline passes
+    BoundedThreadSafeQueue<int> empty(2);
+    int value = 0;
+    passed = passed && !empty.WaitAndPopUntil(value, chrono::steady_clock::now() + chrono::milliseconds(10));
+
+    BoundedThreadSafeQueue<int> full(2);
+    full.TryPush(1);
+    full.TryPush(2);
+    atomic<bool> popGaveUp(false);
+    atomic<bool> pushGaveUp(false);
+    {
+        vector<thread> threads;
+        join_threads joiner(threads);
+        threads.emplace_back([&empty, &popGaveUp] { popGaveUp = !empty.WaitAndPop(); });
+        threads.emplace_back([&full, &pushGaveUp] { pushGaveUp = !full.Push(3); });
+        // give both threads time to block
+        this_thread::sleep_for(chrono::milliseconds(50));
+        empty.Close();
+        full.Close();
+    }
+    return passed && popGaveUp.load() && pushGaveUp.load();
+}
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+int mainChapter4() {
+    const bool boundedQueuePassed = boundedQueueRound();
+    cout << "BoundedThreadSafeQueue: " << (boundedQueuePassed ? "passed" : "FAILED") << '\n';
+    return boundedQueuePassed ? 0 : 1;
+}
+//</editor-fold>
@@ -0,0 +1,188 @@
+#pragma once
+
+#include "algorithm"
+#include "array"
+#include "cstdint"
+#include "cstring"
+#include "iterator"
+#include "memory"
+#include "type_traits"
+#include "vector"
+#include "chapter08/cache_line.h"
+#include "chapter08/parallel_algorithms.h"
+#include "chapter09_advanced_thread_management/thread_pool.h"
+
+/**
+ * Arithmetic types that parallelRadixSort can sort: every integral type except bool
+ * and floating point types that fit into 64 bits.
+ */
+template<typename T>
+constexpr bool isRadixSortable = std::is_arithmetic_v<T> && !std::is_same_v<T, bool> && sizeof(T) <= 8;
+
+/**
+ * Unsigned integer type with the same size as T.
+ */
+template<typename T>
+using RadixKey = std::conditional_t<sizeof(T) == 1, std::uint8_t,
+        std::conditional_t<sizeof(T) == 2, std::uint16_t,
+                std::conditional_t<sizeof(T) == 4, std::uint32_t, std::uint64_t>>>;
+
+/**
+ * Maps a value to an unsigned key, such that comparing the keys as unsigned integers gives
+ * the same order as comparing the values:
+ *  - unsigned integers are used as they are;
+ *  - signed integers get the sign bit flipped, so negative values come first;
+ *  - positive floats get the sign bit flipped, negative floats get all bits flipped,
+ *    because their magnitude grows in the opposite direction.
+ */
+template<typename T>
+RadixKey<T> toRadixKey(T value) {
+    using Key = RadixKey<T>;
+    Key bits;
+    std::memcpy(&bits, &value, sizeof(T));
+    constexpr Key signBit = Key(1) << (sizeof(T) * 8 - 1);
+    if constexpr (std::is_floating_point_v<T>) {
+        return (bits & signBit) ? Key(~bits) : Key(bits | signBit);
+    } else if constexpr (std::is_signed_v<T>) {
+        return Key(bits ^ signBit);
+    } else {
+        return bits;
+    }
+}
+
+/**
+ * Parallel least significant digit radix sort of a contiguous range of numbers
+ * (a plain array or a std::vector). Sorting takes one pass per byte of the key, and each
+ * pass is linear, so for big ranges it is bound by memory bandwidth rather than by the
+ * number of comparisons.
+ *
+ * The range is split into one block per worker of the pool plus one for the calling thread,
+ * and the blocks of every phase are run with run_blocks. Each pass has two parallel phases:
+ *  1. every block counts how many of its elements have each value of the current digit;
+ *  2. from these per-block histograms the exact output position of every (block, digit) pair
+ *  is computed with a prefix sum, and every block scatters its elements to the output.
+ * Blocks write to disjoint parts of the output, and the order within a digit is preserved,
+ * so the sort is stable, which is what makes LSD radix sort correct.
+ *
+ * Scattering to 256 output positions at once would touch 256 different cache lines per block.
+ * Instead elements are first collected in small per-digit write combining buffers of one cache line
+ * and copied to the output a line at a time. The first copy of every digit only fills the output up to
+ * its next cache line boundary, so all the following ones write whole, aligned lines.
+ *
+ * Passes where all elements have the same digit (e.g. the high bytes of small integers) are skipped.
+ *
+ * @param first iterator to the first element of a contiguous range.
+ * @param last
+ */
+template<typename RandomIt>
+void parallelRadixSort(RandomIt first, RandomIt last, thread_pool &pool = default_thread_pool()) {
+    using T = typename std::iterator_traits<RandomIt>::value_type;
+    static_assert(isRadixSortable<T>, "parallelRadixSort can only sort integral and floating point values");
+
+    constexpr std::size_t radixBits = 8;
+    constexpr std::size_t bucketCount = std::size_t(1) << radixBits;
+    constexpr std::size_t passes = sizeof(T);
+    constexpr std::size_t combineSize = sizeof(T) < cache_line_size ? cache_line_size / sizeof(T) : 1;
+    // below this size a single block is faster than the synchronization between the phases
+    constexpr std::size_t minPerBlock = 1 << 16;
+
+    const std::size_t length = std::distance(first, last);
+    if (length < 2) {
+        return;
+    }
+    const std::size_t numBlocks = block_count(length, minPerBlock, pool);
+
+    // every block has its own histogram, aligned so that blocks don't false share
+    struct alignas(cache_line_size) Histogram {
+        std::array<std::size_t, bucketCount> counts;
+    };
+    std::vector<Histogram> histograms(numBlocks);
+    // one write combining line per digit, each starting at a cache line boundary
+    struct alignas(cache_line_size) CombineLine {
+        T values[combineSize];
+    };
+    std::vector<std::unique_ptr<CombineLine[]>> combineBuffers(numBlocks);
+    for (auto &combineBuffer : combineBuffers) {
+        combineBuffer.reset(new CombineLine[bucketCount]);
+    }
+
+    std::vector<T> buffer(length);
+    T *const data = &*first;
+    T *src = data;
+    T *dst = buffer.data();
+
+    auto digitOf = [](T value, unsigned shift) {
+        return static_cast<std::size_t>((toRadixKey(value) >> shift) & (bucketCount - 1));
+    };
+
+    // number of elements that fill the output from [out] up to the next cache line boundary,
+    // or a whole line if [out] is at a boundary or T can't end exactly at one
+    auto elementsToLineEnd = [](const T *out) {
+        const std::size_t bytes = cache_line_size - reinterpret_cast<std::uintptr_t>(out) % cache_line_size;
+        return bytes % sizeof(T) == 0 ? bytes / sizeof(T) : combineSize;
+    };
+
+    for (std::size_t pass = 0; pass < passes; ++pass) {
+        const unsigned shift = static_cast<unsigned>(pass * radixBits);
+
+        run_blocks(src, length, numBlocks, [&](std::size_t block, const T *blockFirst, const T *blockLast) {
+            auto &counts = histograms[block].counts;
+            counts.fill(0);
+            for (const T *p = blockFirst; p != blockLast; ++p) {
+                ++counts[digitOf(*p, shift)];
+            }
+        }, pool);
+
+        // turn the counts into output offsets: all elements with a smaller digit go first,
+        // then elements with the same digit from the preceding blocks
+        bool allInOneBucket = false;
+        std::size_t offset = 0;
+        for (std::size_t digit = 0; digit < bucketCount; ++digit) {
+            const std::size_t digitStart = offset;
+            for (std::size_t block = 0; block < numBlocks; ++block) {
+                const std::size_t count = histograms[block].counts[digit];
+                histograms[block].counts[digit] = offset;
+                offset += count;
+            }
+            if (offset - digitStart == length) {
+                allInOneBucket = true;
+            }
+        }
+        if (allInOneBucket) {
+            continue;
+        }
+
+        run_blocks(src, length, numBlocks, [&](std::size_t block, const T *blockFirst, const T *blockLast) {
+            auto &offsets = histograms[block].counts;
+            CombineLine *const combineBuffer = combineBuffers[block].get();
+            std::array<std::size_t, bucketCount> fill{};
+            // elements to collect before the next flush of every digit
+            std::array<std::size_t, bucketCount> flushAt;
+            for (std::size_t digit = 0; digit < bucketCount; ++digit) {
+                flushAt[digit] = elementsToLineEnd(dst + offsets[digit]);
+            }
+            for (const T *p = blockFirst; p != blockLast; ++p) {
+                const std::size_t digit = digitOf(*p, shift);
+                T *const line = combineBuffer[digit].values;
+                line[fill[digit]++] = *p;
+                if (fill[digit] == flushAt[digit]) {
+                    std::memcpy(dst + offsets[digit], line, fill[digit] * sizeof(T));
+                    offsets[digit] += fill[digit];
+                    fill[digit] = 0;
+                    flushAt[digit] = combineSize;
+                }
+            }
+            // flush the partially filled lines
+            for (std::size_t digit = 0; digit < bucketCount; ++digit) {
+                std::memcpy(dst + offsets[digit], combineBuffer[digit].values, fill[digit] * sizeof(T));
+            }
+        }, pool);
+        std::swap(src, dst);
+    }
+
+    if (src != data) {
+        run_blocks(src, length, numBlocks, [&](std::size_t, const T *blockFirst, const T *blockLast) {
+            std::memcpy(data + (blockFirst - src), blockFirst, (blockLast - blockFirst) * sizeof(T));
+        }, pool);
+    }
+}
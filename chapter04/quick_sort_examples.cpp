@@ -1,7 +1,14 @@
 #include "list"
 #include "algorithm"
 #include "utility"
+#include "exception"
 #include "future"
+#include "iterator"
+#include "type_traits"
+#include "vector"
+#include "chapter04/parallel_radix_sort.h"
+#include "chapter08/parallel_algorithms.h"
+#include "chapter09_advanced_thread_management/thread_pool.h"
 
 using namespace std;
 
@@ -67,14 +74,18 @@ list<T> parallelQuickSort(list<T> input) {
     // The behavior is undefined if lowerPart.end() is an iterator in the range [input.begin(), dividePoint).
     lowerPart.splice(lowerPart.end(), input, input.begin(), dividePoint);
 
-    // sort the lower part of the list on another thread if hardware concurrency allows it
-    // otherwise it is sorted synchronously
-    future<list<T>> newLower(async(&parallelQuickSort<T>, move(lowerPart)));
+    // sort the lower part of the list as a task on the shared thread pool instead of
+    // starting a new thread with std::async on every level of recursion
+    thread_pool &pool = default_thread_pool();
+    future<list<T>> newLower(pool.submit(
+            [lowerPart = move(lowerPart)]() mutable { return parallelQuickSort<T>(move(lowerPart)); }
+    ));
 
     auto newHigher(sequentialQuickSort(move(input)));
 
     result.splice(result.end(), newHigher);
-    result.splice(result.begin(), newLower.get());
+    // run other pending tasks while waiting, so a pool thread never blocks on a task that may be queued behind it
+    result.splice(result.begin(), pool.wait_for_result(newLower));
     return result;
 }
 
@@ -109,3 +120,311 @@ list<T> parallelQuickSort(list<T> input) {
 
 
 
+
+
+//<editor-fold desc="In-place quick sort of random access ranges">
+/**
+ * Ranges shorter than this are sorted with insertion sort: on a handful of elements
+ * it beats quick sort, because it has no recursion and touches memory sequentially.
+ */
+constexpr ptrdiff_t insertionSortCutoff = 24;
+/**
+ * Ranges shorter than this are sorted sequentially: submitting a task costs more
+ * than sorting them on the current thread.
+ */
+constexpr ptrdiff_t parallelSortCutoff = 1 << 14;
+/**
+ * From this size on the pivot is selected as a ninther (median of three medians of three),
+ * which is much harder to fool with patterned input than a plain median of three.
+ */
+constexpr ptrdiff_t nintherCutoff = 128;
+
+template<typename RandomIt, typename Compare>
+void insertionSort(RandomIt first, RandomIt last, Compare comp) {
+    if (first == last) {
+        return;
+    }
+    for (RandomIt i = first + 1; i != last; ++i) {
+        auto value = move(*i);
+        RandomIt j = i;
+        for (; j != first && comp(value, *(j - 1)); --j) {
+            *j = move(*(j - 1));
+        }
+        *j = move(value);
+    }
+}
+
+template<typename RandomIt, typename Compare>
+RandomIt medianOfThree(RandomIt a, RandomIt b, RandomIt c, Compare comp) {
+    if (comp(*a, *b)) {
+        if (comp(*b, *c)) {
+            return b;
+        }
+        return comp(*a, *c) ? c : a;
+    }
+    if (comp(*a, *c)) {
+        return a;
+    }
+    return comp(*b, *c) ? c : b;
+}
+
+template<typename RandomIt, typename Compare>
+RandomIt choosePivot(RandomIt first, RandomIt last, Compare comp) {
+    const ptrdiff_t length = last - first;
+    const RandomIt middle = first + length / 2;
+    if (length < nintherCutoff) {
+        return medianOfThree(first, middle, last - 1, comp);
+    }
+    const ptrdiff_t step = length / 8;
+    return medianOfThree(
+            medianOfThree(first, first + step, first + 2 * step, comp),
+            medianOfThree(middle - step, middle, middle + step, comp),
+            medianOfThree(last - 1 - 2 * step, last - 1 - step, last - 1, comp),
+            comp
+    );
+}
+
+/**
+ * Hoare partition around the pivot chosen by choosePivot(). Both scans stop on elements
+ * equal to the pivot, so ranges with many duplicate keys are still split in halves.
+ * @return position of the pivot: everything before it is not greater,
+ * and everything after it is not less than the pivot.
+ */
+template<typename RandomIt, typename Compare>
+RandomIt partitionAroundPivot(RandomIt first, RandomIt last, Compare comp) {
+    iter_swap(first, choosePivot(first, last, comp));
+    // the pivot stays in *first until the end, so it can be referenced directly
+    const auto &pivot = *first;
+    RandomIt i = first;
+    RandomIt j = last;
+    for (;;) {
+        do {
+            ++i;
+        } while (i != last && comp(*i, pivot));
+        do {
+            --j;
+        } while (comp(pivot, *j)); // stops at first at the latest
+        if (!(i < j)) {
+            break;
+        }
+        iter_swap(i, j);
+    }
+    iter_swap(first, j);
+    return j;
+}
+
+/**
+ * Sequential in-place quick sort of a random access range. Recurses into the smaller part and
+ * loops over the bigger one, so the stack depth is O(log n). If the partitions keep being
+ * unbalanced, which can only happen on adversarial input, it falls back to heap sort
+ * (like introsort), so the worst case stays O(n log n).
+ */
+template<typename RandomIt, typename Compare>
+void sequentialQuickSort(RandomIt first, RandomIt last, Compare comp, int depthLimit) {
+    while (last - first > insertionSortCutoff) {
+        if (depthLimit-- == 0) {
+            make_heap(first, last, comp);
+            sort_heap(first, last, comp);
+            return;
+        }
+        const RandomIt pivot = partitionAroundPivot(first, last, comp);
+        if (pivot - first < last - pivot) {
+            sequentialQuickSort(first, pivot, comp, depthLimit);
+            first = pivot + 1;
+        } else {
+            sequentialQuickSort(pivot + 1, last, comp, depthLimit);
+            last = pivot;
+        }
+    }
+    insertionSort(first, last, comp);
+}
+
+int quickSortDepthLimit(ptrdiff_t length) {
+    int depth = 0;
+    for (; length > 1; length >>= 1) {
+        ++depth;
+    }
+    return 2 * depth;
+}
+
+template<typename RandomIt, typename Compare = less<>>
+void sequentialQuickSort(RandomIt first, RandomIt last, Compare comp = Compare()) {
+    sequentialQuickSort(first, last, comp, quickSortDepthLimit(last - first));
+}
+
+template<typename RandomIt, typename Compare>
+void parallelQuickSort(RandomIt first, RandomIt last, Compare comp, int depthLimit, thread_pool &pool) {
+    if (last - first < parallelSortCutoff) {
+        sequentialQuickSort(first, last, comp, depthLimit);
+        return;
+    }
+    if (depthLimit == 0) {
+        make_heap(first, last, comp);
+        sort_heap(first, last, comp);
+        return;
+    }
+    const RandomIt pivot = partitionAroundPivot(first, last, comp);
+    // the two parts don't overlap, so they can be sorted in place concurrently
+    future<void> lower = pool.submit([=, &pool] {
+        parallelQuickSort(first, pivot, comp, depthLimit - 1, pool);
+    });
+    parallelQuickSort(pivot + 1, last, comp, depthLimit - 1, pool);
+    pool.wait_for_result(lower);
+}
+
+/**
+ * Parallel in-place quick sort of a random access range (e.g. a std::vector). Unlike the
+ * std::list version it doesn't chase pointers or allocate: the range is partitioned in place,
+ * the lower part is sorted as a task on the shared thread pool and the higher part on the
+ * current thread. Small parts are sorted sequentially.
+ */
+template<typename RandomIt, typename Compare = less<>>
+void parallelQuickSort(RandomIt first, RandomIt last, Compare comp = Compare()) {
+    parallelQuickSort(first, last, comp, quickSortDepthLimit(last - first), default_thread_pool());
+}
+//</editor-fold>
+
+//<editor-fold desc="Stable merge sort">
+/**
+ * Ranges shorter than two chunks of this size are sorted with std::stable_sort on the calling thread.
+ */
+constexpr ptrdiff_t minPerMergeChunk = 1 << 13;
+
+/**
+ * Merge path search: the first [diagonal] elements of the stable merge of the sorted ranges
+ * src[aFirst, aFirst + aLength) and src[bFirst, bFirst + bLength) consist of some prefix of the
+ * first range and some prefix of the second one.
+ * @return length of the prefix of the first range.
+ */
+template<typename RandomIt, typename Compare>
+ptrdiff_t mergePathSplit(RandomIt src, ptrdiff_t aFirst, ptrdiff_t aLength, ptrdiff_t bFirst, ptrdiff_t bLength,
+                         ptrdiff_t diagonal, Compare comp) {
+    ptrdiff_t low = max<ptrdiff_t>(0, diagonal - bLength);
+    ptrdiff_t high = min(diagonal, aLength);
+    while (low < high) {
+        const ptrdiff_t mid = low + (high - low) / 2;
+        // equal elements are taken from the first range first, that's what keeps the merge stable
+        if (comp(src[bFirst + diagonal - mid - 1], src[aFirst + mid])) {
+            high = mid;
+        } else {
+            low = mid + 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * Writes the output positions [outFirst, outLast) of the merge of src[begin, mid) and src[mid, end)
+ * to the same positions of dst. Positions are absolute, i.e. begin <= outFirst <= outLast <= end.
+ */
+template<typename SrcIt, typename DstIt, typename Compare>
+void mergePart(SrcIt src, DstIt dst, ptrdiff_t begin, ptrdiff_t mid, ptrdiff_t end,
+               ptrdiff_t outFirst, ptrdiff_t outLast, Compare comp) {
+    const ptrdiff_t aLength = mid - begin;
+    const ptrdiff_t bLength = end - mid;
+    const ptrdiff_t firstDiagonal = outFirst - begin;
+    const ptrdiff_t lastDiagonal = outLast - begin;
+    const ptrdiff_t aFrom = mergePathSplit(src, begin, aLength, mid, bLength, firstDiagonal, comp);
+    const ptrdiff_t aTo = mergePathSplit(src, begin, aLength, mid, bLength, lastDiagonal, comp);
+    merge(make_move_iterator(src + begin + aFrom), make_move_iterator(src + begin + aTo),
+          make_move_iterator(src + mid + (firstDiagonal - aFrom)), make_move_iterator(src + mid + (lastDiagonal - aTo)),
+          dst + outFirst, comp);
+}
+
+/**
+ * Merges neighbouring pairs of the sorted runs src[bounds[i], bounds[i + 1]) into dst. A lone last run
+ * is just moved. The output is split into [numTasks] equal parts and every task produces one of them,
+ * using merge path to find where its part starts in each of the runs, so the work is balanced even
+ * when the runs have different lengths.
+ */
+template<typename SrcIt, typename DstIt, typename Compare>
+void mergeRound(SrcIt src, DstIt dst, const vector<ptrdiff_t> &bounds, Compare comp,
+                size_t numTasks, thread_pool &pool) {
+    const ptrdiff_t length = bounds.back();
+    const size_t runs = bounds.size() - 1;
+    run_blocks(dst, static_cast<size_t>(length), numTasks, [&](size_t, DstIt partOutFirst, DstIt partOutLast) {
+        const ptrdiff_t outFirst = partOutFirst - dst;
+        const ptrdiff_t outLast = partOutLast - dst;
+        for (size_t run = 0; run < runs; run += 2) {
+            const ptrdiff_t begin = bounds[run];
+            const ptrdiff_t mid = bounds[run + 1];
+            const ptrdiff_t end = run + 1 < runs ? bounds[run + 2] : mid;
+            const ptrdiff_t partFirst = max(begin, outFirst);
+            const ptrdiff_t partLast = min(end, outLast);
+            if (partFirst < partLast) {
+                mergePart(src, dst, begin, mid, end, partFirst, partLast, comp);
+            }
+        }
+    }, pool);
+}
+
+/**
+ * Parallel stable merge sort of a random access range: elements that are equivalent according to
+ * [comp] keep their relative order, e.g. records sorted by one of their keys.
+ *
+ * The range is split into one chunk per worker of the shared thread pool plus one for the calling thread,
+ * and every chunk is sorted with std::stable_sort. The sorted chunks are then merged pairwise, log2(chunks)
+ * rounds in total, and within each round all threads merge an equal share of the output (see mergeRound).
+ * The merge rounds move elements back and forth between the range and a buffer of the same size.
+ */
+template<typename RandomIt, typename Compare = less<>>
+void parallelStableSort(RandomIt first, RandomIt last, Compare comp = Compare()) {
+    using T = typename iterator_traits<RandomIt>::value_type;
+    const ptrdiff_t length = last - first;
+    thread_pool &pool = default_thread_pool();
+    const size_t numChunks = min<size_t>(pool.size() + 1, length / minPerMergeChunk);
+    if (numChunks < 2) {
+        stable_sort(first, last, comp);
+        return;
+    }
+
+    vector<T> buffer(make_move_iterator(first), make_move_iterator(last));
+    vector<ptrdiff_t> bounds(numChunks + 1);
+    for (size_t i = 0; i <= numChunks; ++i) {
+        bounds[i] = length * static_cast<ptrdiff_t>(i) / static_cast<ptrdiff_t>(numChunks);
+    }
+    // run_blocks splits the range the same way as bounds
+    run_blocks(buffer.begin(), static_cast<size_t>(length), numChunks,
+               [&](size_t, auto chunkFirst, auto chunkLast) { stable_sort(chunkFirst, chunkLast, comp); }, pool);
+
+    bool inBuffer = true;
+    while (bounds.size() > 2) {
+        if (inBuffer) {
+            mergeRound(buffer.begin(), first, bounds, comp, numChunks, pool);
+        } else {
+            mergeRound(first, buffer.begin(), bounds, comp, numChunks, pool);
+        }
+        inBuffer = !inBuffer;
+        vector<ptrdiff_t> merged;
+        for (size_t i = 0; i < bounds.size(); i += 2) {
+            merged.push_back(bounds[i]);
+        }
+        if (merged.back() != length) {
+            merged.push_back(length);
+        }
+        bounds.swap(merged);
+    }
+    if (inBuffer) {
+        run_blocks(buffer.begin(), static_cast<size_t>(length), numChunks, [&](size_t, auto chunkFirst, auto chunkLast) {
+            move(chunkFirst, chunkLast, first + (chunkFirst - buffer.begin()));
+        }, pool);
+    }
+}
+//</editor-fold>
+
+/**
+ * Sorts a random access range in ascending order with the best parallel algorithm for it:
+ * contiguous ranges of numbers (arrays and std::vector) compared with the default comparator
+ * go to parallelRadixSort, everything else to the in-place parallelQuickSort.
+ */
+template<typename RandomIt, typename Compare = less<>>
+void parallelSort(RandomIt first, RandomIt last, Compare comp = Compare()) {
+    using T = typename iterator_traits<RandomIt>::value_type;
+    constexpr bool isContiguous = is_pointer_v<RandomIt> || is_same_v<RandomIt, typename vector<T>::iterator>;
+    constexpr bool isAscending = is_same_v<Compare, less<>> || is_same_v<Compare, less<T>>;
+    if constexpr (isRadixSortable<T> && isContiguous && isAscending) {
+        parallelRadixSort(first, last);
+    } else {
+        parallelQuickSort(first, last, comp);
+    }
+}
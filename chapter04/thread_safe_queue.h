@@ -4,6 +4,7 @@
 #include "memory"
 #include "mutex"
 #include "condition_variable"
+#include "chrono"
 
 template<typename T>
 class ThreadSafeQueue {
@@ -14,6 +15,18 @@ private:
      * Use condition variable to tell other threads that the queue is not empty.
      */
     std::condition_variable dataCond;
+    /**
+     * Once the queue is closed, waiting threads are woken up and pops return
+     * an empty result instead of blocking when there is no data.
+     */
+    bool closed = false;
+
+    /**
+     * Predicate for waiting threads. Must be called with the lock held.
+     */
+    bool ReadyToPop() const {
+        return !dataQueue.empty() || closed;
+    }
 
 public:
     ThreadSafeQueue() = default;
@@ -23,6 +36,7 @@ public:
     ThreadSafeQueue(const ThreadSafeQueue &other) {
         std::lock_guard lk(other.mut);
         dataQueue = other.dataQueue;
+        closed = other.closed;
     }
 
     void Push(T newValue) {
@@ -32,25 +46,76 @@ public:
         dataCond.notify_one();
     }
 
-    void WaitAndPop(T &value) {
+    /**
+     * Waits for a value to become available.
+     * @return false if the queue has been closed and there is no more data.
+     */
+    bool WaitAndPop(T &value) {
         std::unique_lock lk(mut);
-        dataCond.wait(lk, [this] { return !dataQueue.empty() });
+        dataCond.wait(lk, [this] { return ReadyToPop(); });
+        if (dataQueue.empty()) {
+            return false;
+        }
         value = dataQueue.front();
         dataQueue.pop();
+        return true;
     }
 
+    /**
+     * @return value at the front of the queue or an empty pointer if the queue has been
+     * closed and there is no more data.
+     */
     std::shared_ptr<T> WaitAndPop() {
         // use unique lock because it allows to lock and unlock when necessary
         // lock_guard doesn't allow it.
         std::unique_lock lk(mut);
         // thread trying to pop an element from queue will sleep waiting for the
         // queue to be not empty any longer.
-        dataCond.wait(lk, [this] { return !dataQueue.empty() });
+        dataCond.wait(lk, [this] { return ReadyToPop(); });
+        if (dataQueue.empty()) {
+            return std::shared_ptr<T>();
+        }
         std::shared_ptr<T> res(std::make_shared<T>(dataQueue.front()));
         dataQueue.pop();
         return res;
     }
 
+    /**
+     * Waits for a value until [deadline].
+     * @return false if the deadline has passed or the queue has been closed and there is no more data.
+     */
+    template<typename Clock, typename Duration>
+    bool WaitAndPopUntil(T &value, const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock lk(mut);
+        if (!dataCond.wait_until(lk, deadline, [this] { return ReadyToPop(); }) || dataQueue.empty()) {
+            return false;
+        }
+        value = dataQueue.front();
+        dataQueue.pop();
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    std::shared_ptr<T> WaitAndPopUntil(const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock lk(mut);
+        if (!dataCond.wait_until(lk, deadline, [this] { return ReadyToPop(); }) || dataQueue.empty()) {
+            return std::shared_ptr<T>();
+        }
+        std::shared_ptr<T> res(std::make_shared<T>(dataQueue.front()));
+        dataQueue.pop();
+        return res;
+    }
+
+    template<typename Rep, typename Period>
+    bool WaitAndPopFor(T &value, const std::chrono::duration<Rep, Period> &timeout) {
+        return WaitAndPopUntil(value, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> WaitAndPopFor(const std::chrono::duration<Rep, Period> &timeout) {
+        return WaitAndPopUntil(std::chrono::steady_clock::now() + timeout);
+    }
+
     bool TryPop(T &value) {
         std::lock_guard lk(mut);
         if (dataQueue.empty()) {
@@ -71,6 +136,23 @@ public:
         return res;
     }
 
+    /**
+     * Wakes up all waiting threads. Values that are already in the queue can still be
+     * popped, but once the queue is drained pops return an empty result instead of blocking.
+     */
+    void Close() {
+        {
+            std::lock_guard lk(mut);
+            closed = true;
+        }
+        dataCond.notify_all();
+    }
+
+    bool IsClosed() const {
+        std::lock_guard lk(mut);
+        return closed;
+    }
+
     bool empty() const {
         std::lock_guard lk(mut);
         return dataQueue.empty();
@@ -2,6 +2,12 @@
 #include "thread"
 #include "cassert"
 
+int mainChapter3();
+int mainChapter4();
+int mainChapter6();
+int mainChapter7();
+int mainChapter8();
+
 std::atomic<bool> x, y;
 std::atomic<int> z;
 
@@ -38,4 +44,10 @@ int main() {
     c.join();
     d.join();
     assert(z.load() != 0);
-}
\ No newline at end of file
+    const int chapter3 = mainChapter3();
+    const int chapter4 = mainChapter4();
+    const int chapter6 = mainChapter6();
+    const int chapter7 = mainChapter7();
+    const int chapter8 = mainChapter8();
+    return chapter3 != 0 || chapter4 != 0 || chapter6 != 0 || chapter7 != 0 || chapter8 != 0;
+}
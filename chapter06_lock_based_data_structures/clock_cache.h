@@ -0,0 +1,296 @@
+#pragma once
+
+#include "atomic"
+#include "cstddef"
+#include "cstdint"
+#include "deque"
+#include "functional"
+#include "memory"
+#include "mutex"
+#include "optional"
+#include "shared_mutex"
+#include "unordered_map"
+#include "utility"
+#include "vector"
+#include "chapter06_lock_based_data_structures/mix_hash.h"
+#include "chapter08/cache_line.h"
+
+/**
+ * Default size of a cache entry: the size of its key and value objects, not counting memory
+ * they own on the heap (e.g. the characters of a long std::string).
+ */
+template<typename Key, typename Value>
+struct entry_object_size {
+    std::size_t operator()(const Key &, const Value &) const {
+        return sizeof(Key) + sizeof(Value);
+    }
+};
+
+/**
+ * Thread safe cache with the operations of thread_safe_lookup_table, but with a bound on the total
+ * size of its entries: when adding an entry would exceed the budget, the least recently used entries
+ * (approximately) are evicted to make room.
+ *
+ * The cache is split into shards, each with its own shared_mutex, part of the budget and counters.
+ * Eviction uses the CLOCK algorithm: the entries of a shard sit in a ring of slots, each with
+ * a referenced bit. A hit only sets the bit (if it isn't set already), so reads take the shard's lock
+ * in shared mode and don't reorder anything, unlike an LRU list that is spliced on every hit.
+ * To make room, the clock hand sweeps the ring: it clears the bit of referenced entries, giving them
+ * a second chance, and evicts the first entry whose bit is already clear. New entries start
+ * unreferenced, so an entry that is never read again is the first to go.
+ *
+ * @tparam Key
+ * @tparam Value
+ * @tparam Hash
+ * @tparam EntrySize called as entry_size(key, value), returns the number of bytes charged for an entry.
+ */
+template<typename Key, typename Value, typename Hash=std::hash<Key>,
+        typename EntrySize=entry_object_size<Key, Value>>
+class clock_cache {
+private:
+
+    struct slot_type {
+        std::optional<std::pair<Key, Value>> entry;
+        std::size_t size = 0;
+        // set by readers holding the shard's lock in shared mode
+        mutable std::atomic<bool> referenced{false};
+    };
+
+    class alignas(cache_line_size) shard_type {
+        // slots are never moved, so a deque is used instead of a vector
+        std::deque<slot_type> slots;
+        std::vector<std::size_t> free_slots;
+        std::unordered_map<Key, std::size_t, Hash> index;
+        std::size_t hand = 0;
+        std::size_t used_bytes = 0;
+        const std::size_t budget;
+
+        void free_slot(std::size_t slot_index) {
+            slot_type &slot = slots[slot_index];
+            index.erase(slot.entry->first);
+            used_bytes -= slot.size;
+            slot.entry.reset();
+            slot.size = 0;
+            free_slots.push_back(slot_index);
+        }
+
+        /**
+         * Evicts entries until the shard fits in its budget. The slot [keep] is never evicted.
+         */
+        void evict_to_fit(std::size_t keep) {
+            while (used_bytes > budget) {
+                if (hand >= slots.size()) {
+                    hand = 0;
+                }
+                const std::size_t current = hand++;
+                slot_type &slot = slots[current];
+                if (!slot.entry || current == keep) {
+                    continue;
+                }
+                if (slot.referenced.load(std::memory_order_relaxed)) {
+                    slot.referenced.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+                free_slot(current);
+                evictions.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+    public:
+        // starts a line of its own, so it doesn't straddle two
+        alignas(cache_line_size) mutable std::shared_mutex mutex;
+        // every lookup counts a hit or a miss, so the counters get a line of their own rather than
+        // adding a second write to the line of the mutex
+        alignas(cache_line_size) mutable std::atomic<std::size_t> hits{0};
+        mutable std::atomic<std::size_t> misses{0};
+        std::atomic<std::size_t> evictions{0};
+
+        shard_type(std::size_t budget_, const Hash &hasher) : index(16, hasher), budget(budget_) {}
+
+        /**
+         * Calls f(value) if [key] is in the shard. Must be called with the mutex locked (shared is enough).
+         */
+        template<typename Function>
+        bool visit(const Key &key, Function &f) const {
+            const auto found = index.find(key);
+            if (found == index.end()) {
+                misses.fetch_add(1, std::memory_order_relaxed);
+                return false;
+            }
+            const slot_type &slot = slots[found->second];
+            // check first, so hits on a hot entry don't keep writing to its cache line
+            if (!slot.referenced.load(std::memory_order_relaxed)) {
+                slot.referenced.store(true, std::memory_order_relaxed);
+            }
+            hits.fetch_add(1, std::memory_order_relaxed);
+            f(static_cast<const Value &>(slot.entry->second));
+            return true;
+        }
+
+        /**
+         * Must be called with the mutex locked exclusively.
+         * @return false if the entry is larger than the shard's whole budget, it isn't cached then.
+         */
+        bool add_or_update_mapping(const Key &key, const Value &value, std::size_t size) {
+            const auto found = index.find(key);
+            if (size > budget) {
+                if (found != index.end()) {
+                    free_slot(found->second);
+                }
+                return false;
+            }
+            std::size_t slot_index;
+            if (found != index.end()) {
+                slot_index = found->second;
+                slot_type &slot = slots[slot_index];
+                slot.entry->second = value;
+                used_bytes = used_bytes - slot.size + size;
+                slot.size = size;
+                slot.referenced.store(true, std::memory_order_relaxed);
+            } else {
+                if (free_slots.empty()) {
+                    // a new slot goes through the free list too, so it isn't lost if the entry can't be added
+                    free_slots.push_back(slots.size());
+                    try {
+                        slots.emplace_back();
+                    } catch (...) {
+                        free_slots.pop_back();
+                        throw;
+                    }
+                }
+                slot_index = free_slots.back();
+                slot_type &slot = slots[slot_index];
+                slot.entry.emplace(key, value);
+                try {
+                    index.emplace(key, slot_index);
+                } catch (...) {
+                    slot.entry.reset();
+                    throw;
+                }
+                free_slots.pop_back();
+                slot.size = size;
+                slot.referenced.store(false, std::memory_order_relaxed);
+                used_bytes += size;
+            }
+            evict_to_fit(slot_index);
+            return true;
+        }
+
+        /**
+         * Must be called with the mutex locked exclusively.
+         */
+        void remove_mapping(const Key &key) {
+            const auto found = index.find(key);
+            if (found != index.end()) {
+                free_slot(found->second);
+            }
+        }
+
+        /**
+         * Must be called with the mutex locked (shared is enough).
+         */
+        std::size_t size_in_bytes() const {
+            return used_bytes;
+        }
+
+        std::size_t entry_count() const {
+            return index.size();
+        }
+    };
+
+    std::vector<std::unique_ptr<shard_type>> shards;
+    Hash hasher;
+    EntrySize entry_size;
+
+    shard_type &get_shard(const Key &key) const {
+        // mixed, so that the shard doesn't depend on the same low bits as the shard's own hash table
+        return *shards[(mix_hash(static_cast<std::uint64_t>(hasher(key))) >> 32) % shards.size()];
+    }
+
+public:
+    using key_type = Key;
+    using mapped_value = Value;
+    using hash_type = Hash;
+
+    struct statistics {
+        std::size_t hits;
+        std::size_t misses;
+        std::size_t evictions;
+        std::size_t entries;
+        std::size_t bytes;
+    };
+
+    /**
+     * @param capacity_in_bytes total budget, split evenly between the shards.
+     * @param num_shards number of independently locked parts.
+     */
+    explicit clock_cache(std::size_t capacity_in_bytes, unsigned num_shards = 16,
+                         const EntrySize &entry_size_ = EntrySize(), const Hash &hasher_ = Hash()) :
+            hasher(hasher_), entry_size(entry_size_) {
+        const unsigned shard_count = num_shards ? num_shards : 1;
+        for (unsigned i = 0; i < shard_count; ++i) {
+            shards.emplace_back(new shard_type(capacity_in_bytes / shard_count, hasher));
+        }
+    }
+
+    clock_cache(const clock_cache &) = delete;
+
+    clock_cache &operator=(const clock_cache &) = delete;
+
+    /**
+     * Calls f(const Value &) with the cached value, under the shard's lock in shared mode,
+     * so f must be short and must not access the cache.
+     * @return false on a miss, f isn't called then.
+     */
+    template<typename Function>
+    bool visit(const Key &key, Function f) const {
+        shard_type &shard = get_shard(key);
+        std::shared_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.visit(key, f);
+    }
+
+    std::optional<Value> find(const Key &key) const {
+        std::optional<Value> res;
+        visit(key, [&res](const Value &value) { res = value; });
+        return res;
+    }
+
+    Value value_for(const Key &key, const Value &default_value = Value()) const {
+        Value res = default_value;
+        visit(key, [&res](const Value &value) { res = value; });
+        return res;
+    }
+
+    /**
+     * Adds or replaces the entry, evicting others from its shard if it doesn't fit.
+     * @return false if the entry is larger than a shard's budget, it isn't cached then.
+     */
+    bool add_or_update_mapping(const Key &key, const Value &value) {
+        const std::size_t size = entry_size(key, value);
+        shard_type &shard = get_shard(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        return shard.add_or_update_mapping(key, value, size);
+    }
+
+    void remove_mapping(const Key &key) {
+        shard_type &shard = get_shard(key);
+        std::unique_lock<std::shared_mutex> lock(shard.mutex);
+        shard.remove_mapping(key);
+    }
+
+    /**
+     * Sum of the counters of all shards, each read under its own lock.
+     */
+    statistics stats() const {
+        statistics res{0, 0, 0, 0, 0};
+        for (auto &shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard->mutex);
+            res.hits += shard->hits.load(std::memory_order_relaxed);
+            res.misses += shard->misses.load(std::memory_order_relaxed);
+            res.evictions += shard->evictions.load(std::memory_order_relaxed);
+            res.entries += shard->entry_count();
+            res.bytes += shard->size_in_bytes();
+        }
+        return res;
+    }
+};
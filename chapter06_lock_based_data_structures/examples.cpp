@@ -0,0 +1,26 @@
+#include "iostream"
+#include "chapter06_lock_based_data_structures/lookup_table_round.h"
+#include "chapter06_lock_based_data_structures/thread_safe_lookup_table.h"
+#include "chapter06_lock_based_data_structures/flat_lookup_table.h"
+#include "chapter06_lock_based_data_structures/clock_cache.h"
+
+int mainChapter6() {
+    // starts with the default buckets, so the round grows the table while it runs
+    thread_safe_lookup_table<int, int> lookupTable;
+    const bool lookupTablePassed = checkLookupTableRound(lookupTable);
+    std::cout << "thread_safe_lookup_table: " << (lookupTablePassed ? "passed" : "FAILED")
+              << ", " << lookupTable.get_map().size() << " entries\n";
+
+    flat_lookup_table<int, int> flatTable;
+    const bool flatPassed = checkLookupTableRound(flatTable);
+    std::cout << "flat_lookup_table: " << (flatPassed ? "passed" : "FAILED")
+              << ", " << flatTable.get_map().size() << " entries\n";
+
+    // room for about half of the entries, so the round evicts
+    clock_cache<int, int> cache(1000 * (sizeof(int) + sizeof(int)), 4);
+    const bool cachePassed = checkLookupTableRound(cache, true);
+    const auto stats = cache.stats();
+    std::cout << "clock_cache: " << (cachePassed ? "passed" : "FAILED") << ", " << stats.hits << " hits, "
+              << stats.misses << " misses, " << stats.evictions << " evictions\n";
+    return lookupTablePassed && flatPassed && cachePassed ? 0 : 1;
+}
@@ -0,0 +1,280 @@
+#pragma once
+
+#include "cstddef"
+#include "cstdint"
+#include "functional"
+#include "map"
+#include "memory"
+#include "mutex"
+#include "shared_mutex"
+#include "type_traits"
+#include "utility"
+#include "vector"
+#include "chapter06_lock_based_data_structures/mix_hash.h"
+#include "chapter08/cache_line.h"
+
+/**
+ * Thread safe lookup table with the same operations as thread_safe_lookup_table, but with flat
+ * open addressing storage instead of a std::list per bucket.
+ *
+ * The table is split into stripes. Every stripe is an independent hash table with linear probing
+ * protected by its own shared_mutex, so operations on different stripes don't contend, and a lookup
+ * holds a single lock. A stripe keeps its keys and values in contiguous arrays, together with one
+ * control byte per slot: 0 for an empty slot, otherwise the occupied bit and 7 bits of the key's hash.
+ * A lookup scans the control bytes (64 slots per cache line) and compares the key only when the
+ * hash bits match, so it usually touches one line of control bytes and the slot it is looking for.
+ *
+ * Removal uses backward shift deletion: the entries after the removed one that are out of their home
+ * slot are moved back, so there are no tombstones and probe sequences don't degrade over time.
+ *
+ * A stripe doubles its arrays (under its exclusive lock) when it is more than 3/4 full, so inserts only
+ * allocate while the table grows; updates, removals and re-inserts into a grown table never do.
+ *
+ * Empty slots hold default constructed keys and values, so both have to be default constructible.
+ *
+ * @tparam Key
+ * @tparam Value
+ * @tparam Hash
+ */
+template<typename Key, typename Value, typename Hash=std::hash<Key>>
+class flat_lookup_table {
+private:
+    static constexpr std::uint8_t occupied_bit = 0x80;
+
+    class alignas(cache_line_size) stripe_type {
+        std::vector<std::uint8_t> control;
+        std::vector<Key> keys;
+        std::vector<Value> values;
+        std::size_t mask;
+        std::size_t count;
+    public:
+        mutable std::shared_mutex mutex;
+
+    private:
+        static std::uint8_t control_for(std::uint64_t hash) {
+            return static_cast<std::uint8_t>(occupied_bit | (hash & 0x7f));
+        }
+
+        static std::size_t home_of(std::uint64_t hash, std::size_t mask) {
+            // the low 7 bits go to the control byte, use the bits above them for the slot
+            return (hash >> 7) & mask;
+        }
+
+        std::size_t home_of(std::uint64_t hash) const {
+            return home_of(hash, mask);
+        }
+
+        /**
+         * @return index of the first free slot of the probe sequence of [hash] in [control].
+         */
+        static std::size_t free_slot(const std::vector<std::uint8_t> &control, std::uint64_t hash, std::size_t mask) {
+            std::size_t i = home_of(hash, mask);
+            while (control[i] != 0) {
+                i = (i + 1) & mask;
+            }
+            return i;
+        }
+
+        /**
+         * @return index of the slot holding [key], or capacity() if there is none.
+         */
+        std::size_t find_slot(const Key &key, std::uint64_t hash) const {
+            const std::uint8_t tag = control_for(hash);
+            for (std::size_t i = home_of(hash);; i = (i + 1) & mask) {
+                if (control[i] == 0) {
+                    return capacity();
+                }
+                if (control[i] == tag && keys[i] == key) {
+                    return i;
+                }
+            }
+        }
+
+        /**
+         * Puts a key that is not in the stripe into the first free slot of its probe sequence.
+         */
+        void insert_new(std::uint64_t hash, const Key &key, const Value &value) {
+            const std::size_t i = free_slot(control, hash, mask);
+            keys[i] = key;
+            values[i] = value;
+            // the slot is marked occupied only once the assignments can't throw any more
+            control[i] = control_for(hash);
+            ++count;
+        }
+
+        /**
+         * Rehashes into new arrays, which replace the current ones only once all entries are in,
+         * so a throwing copy leaves the stripe as it was. Entries are moved only if no move can throw.
+         */
+        template<typename Hasher>
+        void grow(const Hasher &hash_of) {
+            constexpr bool nothrow_move = std::is_nothrow_move_assignable_v<Key> &&
+                                          std::is_nothrow_move_assignable_v<Value>;
+            const std::size_t new_capacity = capacity() * 2;
+            const std::size_t new_mask = new_capacity - 1;
+            std::vector<std::uint8_t> new_control(new_capacity, 0);
+            std::vector<Key> new_keys(new_capacity);
+            std::vector<Value> new_values(new_capacity);
+            for (std::size_t i = 0; i < capacity(); ++i) {
+                if (control[i] != 0) {
+                    const std::uint64_t hash = hash_of(keys[i]);
+                    const std::size_t j = free_slot(new_control, hash, new_mask);
+                    if constexpr (nothrow_move) {
+                        new_keys[j] = std::move(keys[i]);
+                        new_values[j] = std::move(values[i]);
+                    } else {
+                        new_keys[j] = keys[i];
+                        new_values[j] = values[i];
+                    }
+                    new_control[j] = control_for(hash);
+                }
+            }
+            control.swap(new_control);
+            keys.swap(new_keys);
+            values.swap(new_values);
+            mask = new_mask;
+        }
+
+    public:
+        explicit stripe_type(std::size_t initial_capacity) :
+                control(initial_capacity, 0), keys(initial_capacity), values(initial_capacity),
+                mask(initial_capacity - 1), count(0) {}
+
+        std::size_t capacity() const {
+            return control.size();
+        }
+
+        Value value_for(const Key &key, std::uint64_t hash, const Value &default_value) const {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            const std::size_t slot = find_slot(key, hash);
+            return slot == capacity() ? default_value : values[slot];
+        }
+
+        template<typename Hasher>
+        void add_or_update_mapping(const Key &key, std::uint64_t hash, const Value &value, const Hasher &hash_of) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            const std::size_t slot = find_slot(key, hash);
+            if (slot != capacity()) {
+                values[slot] = value;
+                return;
+            }
+            if ((count + 1) * 4 > capacity() * 3) {
+                grow(hash_of);
+            }
+            insert_new(hash, key, value);
+        }
+
+        template<typename Hasher>
+        void remove_mapping(const Key &key, std::uint64_t hash, const Hasher &hash_of) {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            std::size_t hole = find_slot(key, hash);
+            if (hole == capacity()) {
+                return;
+            }
+            // move back every following entry whose home slot is not between the hole and its current slot
+            for (std::size_t i = (hole + 1) & mask; control[i] != 0; i = (i + 1) & mask) {
+                const std::size_t home = home_of(hash_of(keys[i]));
+                const bool home_in_hole_to_i = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+                if (!home_in_hole_to_i) {
+                    control[hole] = control[i];
+                    keys[hole] = std::move(keys[i]);
+                    values[hole] = std::move(values[i]);
+                    hole = i;
+                }
+            }
+            control[hole] = 0;
+            keys[hole] = Key();
+            values[hole] = Value();
+            --count;
+        }
+
+        /**
+         * Must be called with the mutex locked.
+         */
+        void copy_to(std::map<Key, Value> &res) const {
+            for (std::size_t i = 0; i < capacity(); ++i) {
+                if (control[i] != 0) {
+                    res.insert({keys[i], values[i]});
+                }
+            }
+        }
+    };
+
+    std::vector<std::unique_ptr<stripe_type>> stripes;
+    Hash hasher;
+    unsigned stripe_shift;
+
+    /**
+     * Mixed, since its bits are used for the stripe, the slot and the control byte.
+     */
+    std::uint64_t hash_of(const Key &key) const {
+        return mix_hash(static_cast<std::uint64_t>(hasher(key)));
+    }
+
+    stripe_type &get_stripe(std::uint64_t hash) const {
+        // the top bits choose the stripe, the bits below them are used inside the stripe
+        return *stripes[stripe_shift == 64 ? 0 : hash >> stripe_shift];
+    }
+
+    static std::size_t round_up_to_power_of_two(std::size_t value) {
+        std::size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+public:
+    using key_type = Key;
+    using mapped_value = Value;
+    using hash_type = Hash;
+
+    /**
+     * @param num_stripes number of independently locked parts, rounded up to a power of two.
+     * @param initial_capacity_per_stripe number of slots each stripe starts with, rounded up to a power of two.
+     */
+    explicit flat_lookup_table(unsigned num_stripes = 16, std::size_t initial_capacity_per_stripe = 16,
+                               const Hash &hasher_ = Hash()) :
+            hasher(hasher_), stripe_shift(64) {
+        const std::size_t stripe_count = round_up_to_power_of_two(num_stripes);
+        for (std::size_t s = stripe_count; s > 1; s >>= 1) {
+            --stripe_shift;
+        }
+        const std::size_t capacity = round_up_to_power_of_two(initial_capacity_per_stripe < 2 ? 2 : initial_capacity_per_stripe);
+        for (std::size_t i = 0; i < stripe_count; ++i) {
+            stripes.emplace_back(new stripe_type(capacity));
+        }
+    }
+
+    flat_lookup_table(const flat_lookup_table &) = delete;
+
+    flat_lookup_table &operator=(const flat_lookup_table &) = delete;
+
+    Value value_for(const Key &key, const Value &default_value = Value()) const {
+        const std::uint64_t hash = hash_of(key);
+        return get_stripe(hash).value_for(key, hash, default_value);
+    }
+
+    void add_or_update_mapping(const Key &key, const Value &value) {
+        const std::uint64_t hash = hash_of(key);
+        get_stripe(hash).add_or_update_mapping(key, hash, value, [this](const Key &k) { return hash_of(k); });
+    }
+
+    void remove_mapping(const Key &key) {
+        const std::uint64_t hash = hash_of(key);
+        get_stripe(hash).remove_mapping(key, hash, [this](const Key &k) { return hash_of(k); });
+    }
+
+    std::map<Key, Value> get_map() const {
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        for (auto &stripe : stripes) {
+            locks.emplace_back(stripe->mutex);
+        }
+
+        std::map<Key, Value> res;
+        for (auto &stripe : stripes) {
+            stripe->copy_to(res);
+        }
+        return res;
+    }
+};
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "thread"
+#include "vector"
+#include "chapter02/joining_thread.h"
+
+/**
+ * Every thread adds, reads and removes its own keys and reads the keys of the other threads,
+ * so the table is used concurrently from all of them. The lookup tables of chapters 6 and 7 have
+ * the same operations, so the same round runs on each of them.
+ * @return number of keys found when reading back the keys that haven't been removed.
+ */
+template<typename Table>
+unsigned lookupTableRound(Table &table, unsigned numThreads = 4, unsigned keysPerThread = 1000) {
+    std::vector<unsigned> found(numThreads, 0);
+    {
+        std::vector<std::thread> threads;
+        join_threads joiner(threads);
+        for (unsigned t = 0; t < numThreads; ++t) {
+            threads.emplace_back([&table, &found, t, numThreads, keysPerThread] {
+                for (unsigned i = 0; i < keysPerThread; ++i) {
+                    const int key = static_cast<int>(t * keysPerThread + i);
+                    table.add_or_update_mapping(key, key);
+                    // a key of another thread, which may or may not be there yet
+                    table.value_for(static_cast<int>(((t + 1) % numThreads) * keysPerThread + i), -1);
+                    if (i % 2) {
+                        table.remove_mapping(key);
+                    }
+                }
+                for (unsigned i = 0; i < keysPerThread; i += 2) {
+                    const int key = static_cast<int>(t * keysPerThread + i);
+                    found[t] += table.value_for(key, -1) == key;
+                }
+            });
+        }
+    }
+    unsigned res = 0;
+    for (unsigned f : found) {
+        res += f;
+    }
+    return res;
+}
+
+/**
+ * Runs lookupTableRound and checks the keys found against the keys that haven't been removed.
+ * @param mayEvict the table drops entries on its own (a cache), so fewer keys may be found.
+ * @return true if all the keys that haven't been removed were found (no more than them if [mayEvict]).
+ */
+template<typename Table>
+bool checkLookupTableRound(Table &table, bool mayEvict = false, unsigned numThreads = 4, unsigned keysPerThread = 1000) {
+    const unsigned expected = numThreads * ((keysPerThread + 1) / 2);
+    const unsigned found = lookupTableRound(table, numThreads, keysPerThread);
+    return mayEvict ? found <= expected : found == expected;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "cstdint"
+
+/**
+ * The MurmurHash3 finalizer: spreads every bit of [h] over the whole result. std::hash of integers
+ * is usually the identity, so hashes are mixed with it before their bits are split up, e.g. some
+ * for the shard or stripe and the rest for a slot within it.
+ */
+inline std::uint64_t mix_hash(std::uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
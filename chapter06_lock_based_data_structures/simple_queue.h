@@ -3,49 +3,119 @@
 #include "memory"
 #include "utility"
 #include "mutex"
+#include "optional"
+#include "chrono"
 #include "condition_variable"
+#include "chapter05/spin_lock.h"
 
 /**
  * Unbounded thread safe queue. Internally uses custom singly linked list
- * with two pointers: head and tail. Head pointer is an std::shared_ptr<node>,
- * tail pointer is a raw pointer to node class. Struct node has two values:
- * std::shared_ptr<T> data that stores a pointer to data object of type T,
- * and std::unique_ptr<node> next that stores a reference to the next node in the list.
+ * with two pointers: head and tail. Both are raw pointers to node class, the queue
+ * owns all the nodes. Struct node has two values: std::optional<T> data that stores
+ * the data object of type T in the node itself, and node *next that stores a pointer
+ * to the next node in the list.
  *
  * Valid invariants:
  *  - tail->next == nullPtr
- *  - tail->data == nullPtr
+ *  - tail->data is empty
  *  - head == tail implies an empty list
  *  - A single element list has head->next == tail
- *  - For each node x in the list, where x != tail, x->data points to an instance of T
+ *  - For each node x in the list, where x != tail, x->data holds an instance of T
  *  and x -> next points to the next node in the list. x->next == tail implies x is the last node in the list.
  *  - Following the next nodes from head will eventually yield tail.
  *
+ * Nodes removed from the head are not deleted, they are put on a per-queue free list and
+ * reused by the following push() calls. Together with storing T inside the node this means
+ * that once the queue has grown to its working size, push() and the pops that move the value
+ * into a T& don't allocate at all. The pops returning std::shared_ptr<T> still allocate the
+ * shared_ptr, which is done before the node is unlinked, so a bad_alloc leaves the value in the queue.
+ * The free list is touched by both pushing and popping threads, so it is guarded by its own
+ * spin lock, which is held only for a couple of pointer assignments.
+ *
  * @tparam T type of values stored in the queue.
  */
 template<typename T>
 class simple_thread_safe_queue {
 private:
     struct node {
-        std::shared_ptr<T> data;
-        std::unique_ptr<node> next;
+        std::optional<T> data;
+        node *next = nullptr;
     };
 
+    /**
+     * Deleter for nodes popped off the queue: instead of freeing the node,
+     * returns it to the free list of the queue.
+     */
+    class node_recycler {
+        simple_thread_safe_queue *queue;
+
+    public:
+        explicit node_recycler(simple_thread_safe_queue *queue_ = nullptr) : queue(queue_) {}
+
+        void operator()(node *n) const {
+            queue->recycle_node(n);
+        }
+    };
+
+    using node_ptr = std::unique_ptr<node, node_recycler>;
+
     std::mutex head_mutex;
     std::mutex tail_mutex;
-    std::unique_ptr<node> head;
+    node *head;
     node *tail;
     std::condition_variable data_cond;
+    /**
+     * Guarded by head_mutex. Once the queue is closed, waiting threads are woken up
+     * and pops return an empty result instead of blocking when there is no data.
+     */
+    bool closed;
+
+    spinlock_mutex free_list_mutex;
+    node *free_list;
+
+    node *acquire_node() {
+        {
+            std::lock_guard free_list_lock(free_list_mutex);
+            if (free_list) {
+                node *const n = free_list;
+                free_list = n->next;
+                n->next = nullptr;
+                return n;
+            }
+        }
+        // the free list is empty, the queue is still growing
+        return new node;
+    }
+
+    void recycle_node(node *n) {
+        // destroy the value outside the lock
+        n->data.reset();
+        std::lock_guard free_list_lock(free_list_mutex);
+        n->next = free_list;
+        free_list = n;
+    }
+
+    static void delete_nodes(node *nodes) {
+        while (nodes) {
+            node *const next = nodes->next;
+            delete nodes;
+            nodes = next;
+        }
+    }
 
     node *get_tail() {
         std::lock_guard tail_lock(tail_mutex);
         return tail;
     }
 
-    std::unique_ptr<node> pop_head() {
-        std::unique_ptr<node> old_head = std::move(head);
-        head = std::move(old_head->next);
-        return old_head;
+    node_ptr pop_head() {
+        node *const old_head = head;
+        head = old_head->next;
+        return node_ptr(old_head, node_recycler(this));
+    }
+
+    bool ready_to_pop() {
+        return head != get_tail() || closed;
     }
 
     /**
@@ -55,85 +125,176 @@ private:
      */
     std::unique_lock<std::mutex> wait_for_data() {
         std::unique_lock<std::mutex> head_lock(head_mutex);
-        data_cond.wait(head_lock, [&] { return head.get() != get_tail(); });
+        data_cond.wait(head_lock, [&] { return ready_to_pop(); });
         return std::move(head_lock);
     }
 
-    std::unique_ptr<node> wait_pop_head() {
-        std::unique_lock<std::mutex> head_lock(wait_for_data());
+    /**
+     * Same as wait_for_data(), but gives up at [deadline].
+     */
+    template<typename Clock, typename Duration>
+    std::unique_lock<std::mutex> wait_for_data_until(const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock<std::mutex> head_lock(head_mutex);
+        data_cond.wait_until(head_lock, deadline, [&] { return ready_to_pop(); });
+        return head_lock;
+    }
+
+    /**
+     * Pops the head if there is data, otherwise returns an empty pointer.
+     * Must be called with the head lock held.
+     */
+    node_ptr pop_head_if_any(std::shared_ptr<T> &res) {
+        if (head == get_tail()) {
+            return node_ptr();
+        }
+        // first allocate the result, while the value is still in the queue: if this throws,
+        // nothing has been popped
+        res = std::make_shared<T>(std::move(*head->data));
+        // second pop the head
         return pop_head();
     }
 
-    std::unique_ptr<node> wait_pop_head(T &value) {
-        std::unique_lock<std::mutex> head_lock(wait_for_data());
+    node_ptr pop_head_if_any(T &value) {
+        if (head == get_tail()) {
+            return node_ptr();
+        }
         // first move data to the value, while still keeping the lock
         value = std::move(*head->data);
         // second pop the head
         return pop_head();
     }
 
-    std::unique_ptr<node> try_pop_head() {
+    node_ptr wait_pop_head(std::shared_ptr<T> &res) {
+        std::unique_lock<std::mutex> head_lock(wait_for_data());
+        // the queue may have been closed while we were waiting
+        return pop_head_if_any(res);
+    }
+
+    node_ptr wait_pop_head(T &value) {
+        std::unique_lock<std::mutex> head_lock(wait_for_data());
+        return pop_head_if_any(value);
+    }
+
+    template<typename Clock, typename Duration>
+    node_ptr wait_pop_head_until(std::shared_ptr<T> &res, const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock<std::mutex> head_lock(wait_for_data_until(deadline));
+        return pop_head_if_any(res);
+    }
+
+    template<typename Clock, typename Duration>
+    node_ptr wait_pop_head_until(T &value, const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock<std::mutex> head_lock(wait_for_data_until(deadline));
+        return pop_head_if_any(value);
+    }
+
+    node_ptr try_pop_head(std::shared_ptr<T> &res) {
         std::lock_guard<std::mutex> head_lock(head_mutex);
-        if (head.get() == get_tail()) {
-            return std::unique_ptr<node>();
-        }
-        return pop_head();
+        return pop_head_if_any(res);
     }
 
-    std::unique_ptr<node> try_pop_head(T &value) {
+    node_ptr try_pop_head(T &value) {
         std::lock_guard<std::mutex> head_lock(head_mutex);
-        if (head.get() == get_tail()) {
-            return std::unique_lock<node>();
-        }
-        value = std::move(*head->data);
-        return pop_head();
+        return pop_head_if_any(value);
     }
 
 public:
-    simple_thread_safe_queue() : head(new node), tail(head.get()) {}
+    simple_thread_safe_queue() : head(new node), tail(head), closed(false), free_list(nullptr) {}
+
+    ~simple_thread_safe_queue() {
+        delete_nodes(head);
+        delete_nodes(free_list);
+    }
 
     simple_thread_safe_queue(const simple_thread_safe_queue &) = delete;
 
     simple_thread_safe_queue &operator=(const simple_thread_safe_queue &) = delete;
 
+    /**
+     * @return value at the front of the queue or an empty pointer if the queue has been
+     * closed and there is no more data.
+     */
     std::shared_ptr<T> wait_and_pop() {
-        const std::unique_ptr<node> old_head = wait_pop_head();
-        return old_head->data;
+        // the node goes back to the free list when old_head is destroyed
+        std::shared_ptr<T> res;
+        const node_ptr old_head = wait_pop_head(res);
+        return res;
     }
 
-    void wait_and_pop(T &value) {
-        const std::unique_ptr<node> old_head = wait_pop_head(value);
+    /**
+     * @return false if the queue has been closed and there is no more data.
+     */
+    bool wait_and_pop(T &value) {
+        const node_ptr old_head = wait_pop_head(value);
+        return static_cast<bool>(old_head);
+    }
+
+    /**
+     * @return value at the front of the queue or an empty pointer if [deadline] has passed
+     * or the queue has been closed and there is no more data.
+     */
+    template<typename Clock, typename Duration>
+    std::shared_ptr<T> wait_and_pop_until(const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::shared_ptr<T> res;
+        const node_ptr old_head = wait_pop_head_until(res, deadline);
+        return res;
+    }
+
+    template<typename Clock, typename Duration>
+    bool wait_and_pop_until(T &value, const std::chrono::time_point<Clock, Duration> &deadline) {
+        const node_ptr old_head = wait_pop_head_until(value, deadline);
+        return static_cast<bool>(old_head);
+    }
+
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> wait_and_pop_for(const std::chrono::duration<Rep, Period> &timeout) {
+        return wait_and_pop_until(std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Rep, typename Period>
+    bool wait_and_pop_for(T &value, const std::chrono::duration<Rep, Period> &timeout) {
+        return wait_and_pop_until(value, std::chrono::steady_clock::now() + timeout);
     }
 
     std::shared_ptr<T> try_pop() {
-        std::unique_ptr<node> old_head = try_pop_head();
-        return old_head ? old_head->data : std::shared_ptr<T>();
+        std::shared_ptr<T> res;
+        const node_ptr old_head = try_pop_head(res);
+        return res;
     }
 
     bool try_pop(T &new_value) {
-        std::unique_ptr<node> old_head = try_pop_head(new_value);
-        return old_head;
+        const node_ptr old_head = try_pop_head(new_value);
+        return static_cast<bool>(old_head);
+    }
+
+    /**
+     * Wakes up all waiting threads. Values that are already in the queue can still be
+     * popped, but once the queue is drained pops return an empty result instead of blocking.
+     */
+    void close() {
+        {
+            std::lock_guard<std::mutex> head_lock(head_mutex);
+            closed = true;
+        }
+        data_cond.notify_all();
     }
 
     bool empty() {
         std::lock_guard<std::mutex> head_lock(head_mutex);
-        return (head.get() == get_tail());
+        return (head == get_tail());
     }
 
     void push(T new_value) {
-        // allocating memory for new_data and p outside a lock
-        // provides for greater concurrency
-        std::shared_ptr<T> new_data(
-                std::make_shared<T>(std::move(new_value))
-        );
-        std::unique_ptr<node> p(new node);
+        // taking a node from the free list (or allocating a new one)
+        // outside the tail lock provides for greater concurrency
+        node_ptr p(acquire_node(), node_recycler(this));
         // only one an add its new node to the list at a time, but the code
-        // to do so is only a few simple pointer assignments, so the lock isn’t held for much time
+        // to do so is only a move of the value into the node and a few simple pointer
+        // assignments, so the lock isn’t held for much time
         {
             std::lock_guard tail_lock(tail_mutex);
-            tail->data = new_data;
-            node *const new_tail = p.get();
-            tail->next = std::move(p);
+            tail->data.emplace(std::move(new_value));
+            node *const new_tail = p.release();
+            tail->next = new_tail;
             tail = new_tail;
         }
         // at this point the mutex is unlocked and another thread can proceed at once
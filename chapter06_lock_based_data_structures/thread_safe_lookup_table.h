@@ -4,21 +4,44 @@
 #include "utility"
 #include "functional"
 #include "list"
+#include "memory"
 #include "mutex"
 #include "shared_mutex"
 #include "algorithm"
+#include "atomic"
 #include "numeric"
 #include "map"
+#include "string"
+#include "string_view"
+#include "type_traits"
+#include "chapter07_lock_free_data_structures/epoch_reclamation.h"
+#include "chapter08/cache_line.h"
 
 /**
- * Simple thread safe lookup table that supports the following operations:
+ * Hash for std::string keys that also accepts std::string_view and C strings, so a table using it
+ * can be searched without constructing a std::string. std::hash gives the same value for a string
+ * and a string_view with the same characters.
+ */
+struct transparent_string_hash {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view key) const {
+        return std::hash<std::string_view>()(key);
+    }
+};
+
+/**
+ * Thread safe lookup table that supports the following operations:
  *  - Add a new key/value pair.
  *  - Change the value associated with a given key.
  *  - Remove a key and its associated value.
  *  - Obtain the value associated with a given key, if any.
+ *  - Read the value in place (visit) or modify it in place (upsert, compute_if_absent),
+ *    under the lock of its bucket.
  *
- *  The number of buckets in the table is set once at construction time. The default is 19 -
- *  an arbitrary prime number.
+ *  The initial number of buckets is set at construction time. The default is 19 -
+ *  an arbitrary prime number. When the table fills up, it grows incrementally: every operation
+ *  moves a few buckets to the bigger array, so no operation pays for the whole rehash.
  *
  * @tparam Key
  * @tparam Value
@@ -27,144 +50,694 @@
 template<typename Key, typename Value, typename Hash=std::hash<Key>>
 class thread_safe_lookup_table {
 private:
-    class bucket_type {
+
+    /**
+     * Smallest power of two not less than [size], but at most a cache line.
+     */
+    static constexpr std::size_t header_alignment(std::size_t size) {
+        std::size_t alignment = 1;
+        while (alignment < size && alignment < cache_line_size) {
+            alignment *= 2;
+        }
+        return alignment;
+    }
+
+    // aligned (and so padded) to a divisor of the cache line size, for the lock stripes of bucket_array
+    class alignas(header_alignment(sizeof(std::list<std::pair<Key, Value>>) + sizeof(bool))) bucket_type {
     public:
         using bucket_value = std::pair<Key, Value>;
         using bucket_data = std::list<bucket_value>;
-        using bucket_iterator = bucket_data::iterator;
+        using bucket_iterator = typename bucket_data::iterator;
+        using const_bucket_iterator = typename bucket_data::const_iterator;
         bucket_data data;
-        // allows many concurrent readers and single writer
-    public:
-        mutable std::shared_mutex mutex;
-    private:
-        bucket_iterator find_entry_for(const Key &key) const {
+        /**
+         * Set on a bucket of the old array once its entries have moved to the new array.
+         */
+        bool migrated = false;
+
+        template<typename K>
+        bucket_iterator find_entry_for(const K &key) {
             return std::find_if(data.begin(), data.end(),
                                 [&](const bucket_value &item) {
                                     return item.first == key;
                                 });
         }
 
-    public:
+        template<typename K>
+        const_bucket_iterator find_entry_for(const K &key) const {
+            return std::find_if(data.begin(), data.end(),
+                                [&](const bucket_value &item) {
+                                    return item.first == key;
+                                });
+        }
 
-        Value value_for(const Key &key, const Value &default_value) const {
-            std::shared_lock<std::shared_mutex> lock(mutex);
-            const bucket_iterator found_entry = find_entry_for(key);
+        // the functions below must be called with the bucket's lock stripe locked
+
+        template<typename K>
+        Value value_for(const K &key, const Value &default_value) const {
+            const const_bucket_iterator found_entry = find_entry_for(key);
             return (found_entry == data.end()) ?
                    default_value : found_entry->second;
         }
 
-        void add_or_update_mapping(const Key &key, const Value &value) {
-            std::unique_lock<std::shared_mutex> lock(mutex);
-            const bucket_iterator found_entry = find_entry_for(key);
+        template<typename K, typename Function>
+        bool visit(const K &key, Function &f) const {
+            const const_bucket_iterator found_entry = find_entry_for(key);
             if (found_entry == data.end()) {
-                data.push_back(bucket_value{key, value});
-            } else {
-                found_entry->second = value;
+                return false;
             }
+            f(static_cast<const Value &>(found_entry->second));
+            return true;
         }
 
-        void remove_mapping(const Key &key) {
-            std::unique_lock<std::shared_mutex> lock(mutex);
+        /**
+         * @return true if a new entry has been added.
+         */
+        template<typename K, typename Function>
+        bool upsert(const K &key, Function &f) {
             const bucket_iterator found_entry = find_entry_for(key);
             if (found_entry != data.end()) {
-                data.erase(found_entry);
+                f(found_entry->second);
+                return false;
             }
+            // the new value is inserted only if f doesn't throw
+            Value value = Value();
+            f(value);
+            data.push_back(bucket_value{Key(key), std::move(value)});
+            return true;
         }
-    };
-
-    std::vector<std::unique_ptr<bucket_type>> buckets;
-    Hash hasher;
-
-    bucket_type &get_bucket(const Key &key) const {
-        const std::size_t bucket_index = hasher(key) % buckets.size();
-        return *buckets[bucket_index];
-    }
 
-public:
-    using key_type = Key;
-    using mapped_value = Value;
-    using hash_type = Hash;
-
-    thread_safe_lookup_table(
-            unsigned num_buckets = 19, const Hash &hasher_ = Hash()
-    ) : buckets(num_buckets), hasher(hasher_) {
-        for (unsigned i = 0; i < num_buckets; ++i) {
-            buckets[i].reset(new bucket_type)
+        /**
+         * @return true if a new entry has been added.
+         */
+        template<typename K, typename Factory>
+        bool compute_if_absent(const K &key, Factory &factory, Value &result) {
+            const bucket_iterator found_entry = find_entry_for(key);
+            if (found_entry != data.end()) {
+                result = found_entry->second;
+                return false;
+            }
+            data.push_back(bucket_value{Key(key), factory()});
+            result = data.back().second;
+            return true;
         }
-    }
 
-    thread_safe_lookup_table(const thread_safe_lookup_table &) = delete;
-
-    thread_safe_lookup_table &operator=(thread_safe_lookup_table &) = delete;
+        /**
+         * @return true if a new entry has been added.
+         */
+        bool add_or_update_mapping(const Key &key, const Value &value) {
+            const bucket_iterator found_entry = find_entry_for(key);
+            if (found_entry == data.end()) {
+                data.push_back(bucket_value{key, value});
+                return true;
+            }
+            found_entry->second = value;
+            return false;
+        }
 
-    Value value_for(const Key &key, const Value &default_value = Value()) const {
-        return get_bucket(key).value_for(key, default_value);
-    }
+        /**
+         * @return true if an entry has been removed.
+         */
+        bool remove_mapping(const Key &key) {
+            const bucket_iterator found_entry = find_entry_for(key);
+            if (found_entry == data.end()) {
+                return false;
+            }
+            data.erase(found_entry);
+            return true;
+        }
+    };
 
-    void add_or_update_mapping(const Key &key, const Value &value) {
-        get_bucket(key).add_or_update_mapping(key, value);
-    }
+    static_assert(cache_line_size % sizeof(bucket_type) == 0, "bucket headers must not straddle cache lines");
 
-    void remove_mapping(const Key &key) {
-        get_bucket(key).remove_mapping(key);
-    }
+    struct alignas(cache_line_size) cache_line {
+        unsigned char bytes[cache_line_size];
+    };
 
-    std::map<Key, Value> get_map() const {
-        std::vector<std::unique_lock<std::shared_mutex>> locks;
-        for (unsigned i = 0; i < buckets.size(); ++i) {
+    struct alignas(cache_line_size) lock_stripe {
+        // allows many concurrent readers and single writer
+        std::shared_mutex mutex;
+    };
 
-            locks.push_back(
-                    std::unique_lock<std::shared_mutex>(buckets[i]->mutex)
-            );
+    /**
+     * The bucket headers (list heads) are stored contiguously, starting at a cache line boundary,
+     * and are guarded by lock stripes kept in a separate array, one shared_mutex per cache line.
+     * Every header is padded to a power of two size, so no header straddles two lines, and all buckets
+     * whose headers share a cache line use the same stripe: writers under different locks never write
+     * to the same line. The number of stripes can be limited at construction time (it doesn't
+     * change when the table grows); by default every cache line of headers has its own stripe.
+     */
+    struct bucket_array {
+        const std::size_t size;
+        // raw storage of the bucket headers, so the first one starts at a cache line boundary
+        std::unique_ptr<cache_line[]> storage;
+        bucket_type *const buckets;
+        const std::size_t stripe_count;
+        std::unique_ptr<lock_stripe[]> stripes;
+
+        static std::size_t lines_for(std::size_t size) {
+            return (size * sizeof(bucket_type) + cache_line_size - 1) / cache_line_size;
         }
 
-        std::map<Key, Value> res;
-        for (unsigned i = 0; i < buckets.size(); ++i) {
-            for (bucket_type::bucket_iterator it = buckets[i]->data.begin();
-                 it != buckets[i]->data.end(); ++it) {
-                res.insert(*it);
-            }
+        /**
+         * @param max_stripes 0 for one lock stripe per cache line of bucket headers.
+         */
+        bucket_array(std::size_t size_, std::size_t max_stripes) :
+                size(size_), storage(new cache_line[lines_for(size_)]),
+                buckets(reinterpret_cast<bucket_type *>(storage.get())),
+                stripe_count(max_stripes && max_stripes < lines_for(size_) ? max_stripes : lines_for(size_)),
+                stripes(new lock_stripe[stripe_count]) {
+            std::uninitialized_default_construct_n(buckets, size);
         }
-        return res;
-    }
-};
 
+        bucket_array(const bucket_array &) = delete;
 
+        bucket_array &operator=(const bucket_array &) = delete;
 
+        ~bucket_array() {
+            std::destroy_n(buckets, size);
+        }
 
+        std::size_t index_for(std::size_t hash) const {
+            return hash % size;
+        }
 
+        /**
+         * Lock stripe guarding the bucket at [index]: buckets whose headers start in the same
+         * cache line share it, and the lines are spread over the stripes round robin.
+         */
+        std::shared_mutex &mutex_for(std::size_t index) const {
+            return stripes[index * sizeof(bucket_type) / cache_line_size % stripe_count].mutex;
+        }
+    };
 
+    /**
+     * The bucket arrays in use. It is never changed after it has been published, except for the migration
+     * counters, which belong to the resize it describes.
+     *
+     * The current and the old array are published together through one atomic pointer to a table_state.
+     * An operation on a single key only loads it inside an epoch_guard, so when no resize is running it
+     * writes to nothing shared except the cache line of its stripe. A resize that starts or finishes
+     * replaces the table_state under an exclusive lock on resize_mutex and retires the replaced state
+     * (and the old array) with epoch based reclamation, so an operation that has loaded it before the swap
+     * can still use it.
+     */
+    struct table_state {
+        bucket_array *buckets;
+        /**
+         * Buckets that are being migrated to [buckets], nullptr if no resize is in progress.
+         */
+        bucket_array *old_buckets;
+        std::atomic<std::size_t> next_to_migrate{0};
+        std::atomic<std::size_t> migrated_buckets{0};
+    };
 
+    static constexpr std::size_t max_load_factor = 2;
+    /**
+     * Number of old buckets migrated by every operation on a single key while a resize is in progress.
+     */
+    static constexpr std::size_t migration_batch = 2;
+
+    /**
+     * Locked exclusively to replace the table_state, in shared mode by the operations on the whole table.
+     */
+    mutable std::shared_mutex resize_mutex;
+    /**
+     * Maximum number of lock stripes of a bucket array, 0 for one per cache line of bucket headers.
+     */
+    const std::size_t max_lock_stripes;
+    // mutable, since lookups migrate buckets and finish resizes too
+    mutable std::atomic<table_state *> state;
+    std::atomic<std::size_t> bucket_count;
+    std::atomic<std::size_t> entry_count;
+    Hash hasher;
 
+    /**
+     * Calls f(bucket) with the bucket that currently holds [key] locked by a Lock.
+     * While a resize runs, the key's bucket in the old array is locked first: if it hasn't been migrated
+     * yet, f works there, otherwise on the new array. If the new bucket has been migrated too (the state
+     * was loaded before another resize started), the state is loaded again.
+     * Must be called inside an epoch_guard.
+     */
+    template<typename Lock, typename K, typename Function>
+    auto with_bucket_for(const K &key, Function f) const {
+        const std::size_t hash = hasher(key);
+        for (;;) {
+            const table_state *const current = state.load(std::memory_order_acquire);
+            if (current->old_buckets) {
+                const std::size_t old_index = current->old_buckets->index_for(hash);
+                bucket_type &old_bucket = current->old_buckets->buckets[old_index];
+                Lock lock(current->old_buckets->mutex_for(old_index));
+                if (!old_bucket.migrated) {
+                    return f(old_bucket);
+                }
+            }
+            const std::size_t index = current->buckets->index_for(hash);
+            bucket_type &bucket = current->buckets->buckets[index];
+            Lock lock(current->buckets->mutex_for(index));
+            if (!bucket.migrated) {
+                return f(bucket);
+            }
+            // the state was loaded before another resize started, and the bucket has moved on since
+        }
+    }
 
+    /**
+     * Moves the entries of one old bucket to the new array. A resize to 2n + 1 buckets starts when the
+     * table holds more than max_load_factor entries per bucket; the old array is kept next to the new one,
+     * and every operation on a single key migrates a few old buckets (migration_batch) until none is left.
+     * The bucket's list nodes are spliced into the new buckets under its lock, so nothing is copied
+     * or allocated.
+     *
+     * The old stripe is locked first and the new ones after it. Nothing else holds two stripe locks
+     * except get_map(), which locks in the same order.
+     */
+    void migrate_bucket(const table_state &current, std::size_t old_index) const {
+        bucket_type &old_bucket = current.old_buckets->buckets[old_index];
+        std::unique_lock<std::shared_mutex> old_lock(current.old_buckets->mutex_for(old_index));
+        while (!old_bucket.data.empty()) {
+            const std::size_t index = current.buckets->index_for(hasher(old_bucket.data.front().first));
+            bucket_type &bucket = current.buckets->buckets[index];
+            std::unique_lock<std::shared_mutex> lock(current.buckets->mutex_for(index));
+            bucket.data.splice(bucket.data.end(), old_bucket.data, old_bucket.data.begin());
+        }
+        old_bucket.migrated = true;
+    }
 
+    /**
+     * Migrates the next old bucket for a lookup, but only if it can lock the old stripe and all the new
+     * stripes the entries go to without waiting, so lookups don't serialize with each other, with writers
+     * or with walks. The bucket is claimed only once all its locks are held.
+     * @return false if a stripe was busy, another thread has claimed the bucket or none is left.
+     */
+    bool try_migrate_next_bucket(table_state &current) const {
+        const std::size_t index = current.next_to_migrate.load(std::memory_order_relaxed);
+        if (index >= current.old_buckets->size) {
+            return false;
+        }
+        bucket_type &old_bucket = current.old_buckets->buckets[index];
+        std::unique_lock<std::shared_mutex> old_lock(current.old_buckets->mutex_for(index), std::try_to_lock);
+        if (!old_lock.owns_lock()) {
+            return false;
+        }
+        std::vector<std::shared_mutex *> new_mutexes;
+        for (const auto &entry : old_bucket.data) {
+            new_mutexes.push_back(&current.buckets->mutex_for(current.buckets->index_for(hasher(entry.first))));
+        }
+        std::sort(new_mutexes.begin(), new_mutexes.end());
+        new_mutexes.erase(std::unique(new_mutexes.begin(), new_mutexes.end()), new_mutexes.end());
+        std::vector<std::unique_lock<std::shared_mutex>> new_locks;
+        new_locks.reserve(new_mutexes.size());
+        for (std::shared_mutex *mutex : new_mutexes) {
+            new_locks.emplace_back(*mutex, std::try_to_lock);
+            if (!new_locks.back().owns_lock()) {
+                return false;
+            }
+        }
+        std::size_t expected = index;
+        if (!current.next_to_migrate.compare_exchange_strong(expected, index + 1, std::memory_order_relaxed)) {
+            return false;
+        }
+        while (!old_bucket.data.empty()) {
+            const std::size_t new_index = current.buckets->index_for(hasher(old_bucket.data.front().first));
+            bucket_type &bucket = current.buckets->buckets[new_index];
+            bucket.data.splice(bucket.data.end(), old_bucket.data, old_bucket.data.begin());
+        }
+        old_bucket.migrated = true;
+        return true;
+    }
 
+    /**
+     * The lookups' share of migrate_some_buckets(): migrates up to migration_batch old buckets whose
+     * stripes are free and finishes the resize if they were the last ones.
+     * Must be called inside an epoch_guard, without any stripe locked.
+     */
+    void try_migrate_some_buckets() const {
+        table_state *const current = state.load(std::memory_order_acquire);
+        if (!current->old_buckets) {
+            return;
+        }
+        for (std::size_t i = 0; i < migration_batch && try_migrate_next_bucket(*current); ++i) {
+            current->migrated_buckets.fetch_add(1, std::memory_order_acq_rel);
+        }
+        if (current->migrated_buckets.load(std::memory_order_acquire) == current->old_buckets->size) {
+            try_finish_resize(current);
+        }
+    }
 
+    /**
+     * Migrates up to migration_batch old buckets and finishes the resize once all of them are migrated.
+     * Must be called inside an epoch_guard, without any stripe locked.
+     */
+    void migrate_some_buckets() const {
+        table_state *const current = state.load(std::memory_order_acquire);
+        if (!current->old_buckets) {
+            return;
+        }
+        for (std::size_t i = 0; i < migration_batch; ++i) {
+            const std::size_t index = current->next_to_migrate.fetch_add(1, std::memory_order_relaxed);
+            if (index >= current->old_buckets->size) {
+                break;
+            }
+            migrate_bucket(*current, index);
+            current->migrated_buckets.fetch_add(1, std::memory_order_acq_rel);
+        }
+        // checked on every call, since the thread that has migrated the last bucket may have backed off
+        if (current->migrated_buckets.load(std::memory_order_acquire) == current->old_buckets->size) {
+            try_finish_resize(current);
+        }
+    }
 
+    /**
+     * Replaces [finished], whose old buckets are all migrated, unless a for_each_entry() or get_map()
+     * holds resize_mutex: then the resize is left to a later operation, so no operation on a single key
+     * waits for a walk. Must be called inside an epoch_guard, so [finished] can't be reclaimed meanwhile.
+     */
+    void try_finish_resize(table_state *finished) const {
+        {
+            std::unique_lock<std::shared_mutex> lock(resize_mutex, std::try_to_lock);
+            if (!lock.owns_lock() || state.load(std::memory_order_relaxed) != finished) {
+                // a walk is running, or another thread has finished the resize already
+                return;
+            }
+            state.store(new table_state{finished->buckets, nullptr}, std::memory_order_release);
+        }
+        epoch_reclamation::retire(finished->old_buckets);
+        epoch_reclamation::retire(finished);
+    }
 
+    /**
+     * Starts a resize if the table has grown past max_load_factor and no resize is in progress.
+     */
+    void grow_if_needed() {
+        const std::size_t current_count = bucket_count.load(std::memory_order_relaxed);
+        if (entry_count.load(std::memory_order_relaxed) <= current_count * max_load_factor) {
+            return;
+        }
+        table_state *replaced;
+        {
+            // operations on single keys don't take resize_mutex, so holding it while the new array is
+            // allocated only holds up walks. If a walk is running, a later operation starts the resize.
+            std::unique_lock<std::shared_mutex> lock(resize_mutex, std::try_to_lock);
+            if (!lock.owns_lock()) {
+                return;
+            }
+            replaced = state.load(std::memory_order_relaxed);
+            if (replaced->old_buckets || replaced->buckets->size != current_count) {
+                // another thread has started a resize in the meantime
+                return;
+            }
+            std::unique_ptr<bucket_array> new_buckets(new bucket_array(current_count * 2 + 1, max_lock_stripes));
+            std::unique_ptr<table_state> new_state(new table_state{new_buckets.get(), replaced->buckets});
+            new_buckets.release();
+            state.store(new_state.release(), std::memory_order_release);
+            bucket_count.store(current_count * 2 + 1, std::memory_order_relaxed);
+        }
+        // both arrays are still in use, only the state object is retired
+        epoch_reclamation::retire(replaced);
+    }
 
+    /**
+     * Calls f(bucket) with the bucket that holds [key] locked exclusively, then does the bookkeeping
+     * of a modifying operation: updates entry_count (f returns the change), migrates some buckets
+     * and starts or finishes a resize if needed.
+     */
+    template<typename K, typename Function>
+    void modify(const K &key, Function f) {
+        {
+            epoch_reclamation::epoch_guard guard;
+            const int added = with_bucket_for<std::unique_lock<std::shared_mutex>>(key, f);
+            if (added > 0) {
+                entry_count.fetch_add(1, std::memory_order_relaxed);
+            } else if (added < 0) {
+                entry_count.fetch_sub(1, std::memory_order_relaxed);
+            }
+            migrate_some_buckets();
+        }
+        grow_if_needed();
+    }
 
+    /**
+     * Calls f(bucket) with the bucket that holds [key] locked in shared mode, then migrates the buckets
+     * it can without waiting for a lock, so a table that is only read still finishes its resize.
+     * Even lookups lock a shared mutex. For data that is read far more often than modified,
+     * rcu_lookup_table offers the same operations with lookups that don't lock at all.
+     */
+    template<typename K, typename Function>
+    auto read(const K &key, Function f) const {
+        epoch_reclamation::epoch_guard guard;
+        auto res = with_bucket_for<std::shared_lock<std::shared_mutex>>(key, f);
+        try_migrate_some_buckets();
+        return res;
+    }
 
+    template<typename H, typename = void>
+    struct is_transparent_hash : std::false_type {
+    };
 
+    template<typename H>
+    struct is_transparent_hash<H, std::void_t<typename H::is_transparent>> : std::true_type {
+    };
 
+    /**
+     * Key types other than Key are accepted only with a transparent Hash (one with an is_transparent member
+     * type, e.g. transparent_string_hash): then the lookups take any key type that Hash accepts and that
+     * compares equal with Key, e.g. std::string_view for std::string.
+     */
+    template<typename K>
+    using enable_if_lookup_key = std::enable_if_t<is_transparent_hash<Hash>::value && !std::is_same_v<K, Key>>;
+
+    template<typename K, typename Function>
+    bool visit_entry(const K &key, Function &f) const {
+        return read(key, [&](const bucket_type &bucket) {
+            return bucket.visit(key, f);
+        });
+    }
 
+    template<typename K, typename Function>
+    bool upsert_entry(const K &key, Function &f) {
+        bool added = false;
+        modify(key, [&](bucket_type &bucket) {
+            added = bucket.upsert(key, f);
+            return added ? 1 : 0;
+        });
+        return added;
+    }
 
+    template<typename K, typename Factory>
+    Value compute_entry_if_absent(const K &key, Factory &factory) {
+        Value result = Value();
+        const auto copy_result = [&result](const Value &value) { result = value; };
+        if (visit_entry(key, copy_result)) {
+            return result;
+        }
+        // the key may have been added since, compute_if_absent checks again under the exclusive lock
+        modify(key, [&](bucket_type &bucket) {
+            return bucket.compute_if_absent(key, factory, result) ? 1 : 0;
+        });
+        return result;
+    }
 
+public:
+    using key_type = Key;
+    using mapped_value = Value;
+    using hash_type = Hash;
 
+    /**
+     * @param num_buckets initial number of buckets.
+     * @param hasher_
+     * @param num_lock_stripes maximum number of locks guarding the buckets, independent of their number.
+     * 0 (the default) gives one lock per cache line of bucket headers.
+     */
+    thread_safe_lookup_table(
+            unsigned num_buckets = 19, const Hash &hasher_ = Hash(), unsigned num_lock_stripes = 0
+    ) : max_lock_stripes(num_lock_stripes), state(nullptr),
+        bucket_count(num_buckets ? num_buckets : 1), entry_count(0), hasher(hasher_) {
+        std::unique_ptr<bucket_array> initial(new bucket_array(bucket_count.load(), num_lock_stripes));
+        state.store(new table_state{initial.get(), nullptr});
+        initial.release();
+    }
 
+    /**
+     * The arrays and states replaced by earlier resizes have been retired and are deleted by epoch_reclamation.
+     */
+    ~thread_safe_lookup_table() {
+        table_state *const current = state.load();
+        delete current->old_buckets;
+        delete current->buckets;
+        delete current;
+    }
 
+    thread_safe_lookup_table(const thread_safe_lookup_table &) = delete;
 
+    thread_safe_lookup_table &operator=(thread_safe_lookup_table &) = delete;
 
+    /**
+     * Although const, a lookup helps a running resize: it may migrate buckets and finish the resize,
+     * which allocates, so it may throw std::bad_alloc. No entry is lost or changed then.
+     */
+    Value value_for(const Key &key, const Value &default_value = Value()) const {
+        return read(key, [&](const bucket_type &bucket) {
+            return bucket.value_for(key, default_value);
+        });
+    }
 
+    template<typename K, typename = enable_if_lookup_key<K>>
+    Value value_for(const K &key, const Value &default_value = Value()) const {
+        return read(key, [&](const bucket_type &bucket) {
+            return bucket.value_for(key, default_value);
+        });
+    }
 
+    /**
+     * Calls f(const Value &) with the value associated with [key], without copying it. The bucket is
+     * locked in shared mode while f runs, so f must be short and must not access the table.
+     * Like value_for(), it may migrate buckets of a running resize, so it may throw std::bad_alloc.
+     * @return false if there is no such key, f isn't called then.
+     */
+    template<typename Function>
+    bool visit(const Key &key, Function f) const {
+        return visit_entry(key, f);
+    }
 
+    template<typename K, typename Function, typename = enable_if_lookup_key<K>>
+    bool visit(const K &key, Function f) const {
+        return visit_entry(key, f);
+    }
 
+    void add_or_update_mapping(const Key &key, const Value &value) {
+        modify(key, [&](bucket_type &bucket) {
+            return bucket.add_or_update_mapping(key, value) ? 1 : 0;
+        });
+    }
 
+    /**
+     * Atomic read-modify-write: calls f(Value &) with the value associated with [key], or with
+     * a value initialized Value that is then added under [key]. The bucket is locked exclusively
+     * while f runs, so f must be short and must not access the table.
+     * @return true if a new entry has been added.
+     */
+    template<typename Function>
+    bool upsert(const Key &key, Function f) {
+        return upsert_entry(key, f);
+    }
 
+    template<typename K, typename Function, typename = enable_if_lookup_key<K>>
+    bool upsert(const K &key, Function f) {
+        return upsert_entry(key, f);
+    }
 
+    /**
+     * Returns the value associated with [key]. If there is none, adds factory() under [key] and
+     * returns it. A hit takes only a shared lock; factory is called at most once per key, under the
+     * exclusive lock of the bucket, so it must not access the table.
+     */
+    template<typename Factory>
+    Value compute_if_absent(const Key &key, Factory factory) {
+        return compute_entry_if_absent(key, factory);
+    }
 
+    template<typename K, typename Factory, typename = enable_if_lookup_key<K>>
+    Value compute_if_absent(const K &key, Factory factory) {
+        return compute_entry_if_absent(key, factory);
+    }
 
+    void remove_mapping(const Key &key) {
+        modify(key, [&](bucket_type &bucket) {
+            return bucket.remove_mapping(key) ? -1 : 0;
+        });
+    }
 
+    /**
+     * Calls sink(key, value) for every entry, locking the stripe of one bucket at a time in shared
+     * mode, so writers are held up only while a bucket of their stripe is being read. A resize that would
+     * start or finish during the walk is left to a later operation instead of waiting for the walk.
+     *
+     * The entries of every bucket are seen as one consistent state, but writes to other buckets that
+     * run during the walk may or may not be seen. Every entry that is in the table for the whole walk
+     * is passed to the sink exactly once, even if a resize migrates it in the meantime.
+     * A resize can't start or finish before the walk is over.
+     *
+     * The sink is called with the bucket locked, so it must not access the table.
+     */
+    template<typename Sink>
+    void for_each_entry(Sink sink) const {
+        std::shared_lock<std::shared_mutex> resize_lock(resize_mutex);
+        const table_state *const current = state.load(std::memory_order_acquire);
+        const bucket_array *const old_buckets = current->old_buckets;
+        const bucket_array *const buckets = current->buckets;
+        // old buckets that still held their entries when they were read; the entries migrated from them
+        // afterwards are already passed to the sink and must be skipped in the new array
+        std::vector<bool> read_before_migration;
+        if (old_buckets) {
+            read_before_migration.resize(old_buckets->size, false);
+            for (std::size_t i = 0; i < old_buckets->size; ++i) {
+                const bucket_type &bucket = old_buckets->buckets[i];
+                std::shared_lock<std::shared_mutex> lock(old_buckets->mutex_for(i));
+                if (!bucket.migrated) {
+                    read_before_migration[i] = true;
+                    for (const auto &entry : bucket.data) {
+                        sink(entry.first, entry.second);
+                    }
+                }
+            }
+        }
+        for (std::size_t i = 0; i < buckets->size; ++i) {
+            const bucket_type &bucket = buckets->buckets[i];
+            std::shared_lock<std::shared_mutex> lock(buckets->mutex_for(i));
+            for (const auto &entry : bucket.data) {
+                if (old_buckets && read_before_migration[old_buckets->index_for(hasher(entry.first))]) {
+                    continue;
+                }
+                sink(entry.first, entry.second);
+            }
+        }
+    }
 
+    /**
+     * Entries sorted by key, collected with for_each_entry(), so with the same consistency.
+     */
+    std::vector<std::pair<Key, Value>> snapshot() const {
+        std::vector<std::pair<Key, Value>> res;
+        res.reserve(entry_count.load(std::memory_order_relaxed));
+        for_each_entry([&res](const Key &key, const Value &value) {
+            res.emplace_back(key, value);
+        });
+        std::sort(res.begin(), res.end(),
+                  [](const std::pair<Key, Value> &a, const std::pair<Key, Value> &b) {
+                      return a.first < b.first;
+                  });
+        return res;
+    }
 
+    /**
+     * Consistent copy of the whole table: all lock stripes are locked (in shared mode) at once, so writers
+     * are blocked until the copy is done. Prefer for_each_entry() or snapshot() for periodic dumps.
+     */
+    std::map<Key, Value> get_map() const {
+        std::shared_lock<std::shared_mutex> resize_lock(resize_mutex);
+        const table_state *const current = state.load(std::memory_order_acquire);
+        std::vector<std::shared_lock<std::shared_mutex>> locks;
+        std::vector<const bucket_array *> arrays;
+        if (current->old_buckets) {
+            arrays.push_back(current->old_buckets);
+        }
+        arrays.push_back(current->buckets);
+        for (const bucket_array *array : arrays) {
+            for (std::size_t i = 0; i < array->stripe_count; ++i) {
+                locks.emplace_back(array->stripes[i].mutex);
+            }
+        }
 
+        std::map<Key, Value> res;
+        for (const bucket_array *array : arrays) {
+            for (std::size_t i = 0; i < array->size; ++i) {
+                for (typename bucket_type::const_bucket_iterator it = array->buckets[i].data.begin();
+                     it != array->buckets[i].data.end(); ++it) {
+                    res.insert(*it);
+                }
+            }
+        }
+        return res;
+    }
+};
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "queue"
+#include "algorithm"
 #include "memory"
 #include "mutex"
 #include "condition_variable"
+#include "chrono"
+#include "vector"
 
 /**
  * There’s a slight twist with regard to exception safety in that if more than one
@@ -31,6 +34,31 @@ private:
      * Use condition variable to tell other threads that the queue is not empty.
      */
     std::condition_variable dataCond;
+    /**
+     * Once the queue is closed, waiting threads are woken up and pops return
+     * an empty result instead of blocking when there is no data.
+     */
+    bool closed = false;
+
+    /**
+     * Predicate for waiting threads. Must be called with the lock held.
+     */
+    bool ReadyToPop() const {
+        return !dataQueue.empty() || closed;
+    }
+
+    /**
+     * Moves at most [max] elements from the front of the queue to [batch].
+     * Must be called with the lock held.
+     */
+    void TakeBatch(std::vector<std::shared_ptr<T>> &batch, std::size_t max) {
+        const std::size_t count = std::min(max, dataQueue.size());
+        batch.reserve(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            batch.push_back(std::move(dataQueue.front()));
+            dataQueue.pop();
+        }
+    }
 
 public:
     ThreadSafeQueueRevised() = default;
@@ -40,6 +68,7 @@ public:
     ThreadSafeQueueRevised(const ThreadSafeQueueRevised &other) {
         std::lock_guard lk(other.mut);
         dataQueue = other.dataQueue;
+        closed = other.closed;
     }
 
     void Push(T newValue) {
@@ -52,25 +81,141 @@ public:
         dataCond.notify_one();
     }
 
-    void WaitAndPop(T &value) {
+    /**
+     * Pushes all values from [first, last) into the queue. Values are wrapped into
+     * std::shared_ptr outside the lock, then the whole run is appended under a single
+     * lock and waiting threads are notified once.
+     * @tparam InputIterator iterator whose value type is convertible to T.
+     */
+    template<typename InputIterator>
+    void PushRange(InputIterator first, InputIterator last) {
+        std::vector<std::shared_ptr<T>> batch;
+        for (; first != last; ++first) {
+            batch.push_back(std::make_shared<T>(*first));
+        }
+        if (batch.empty()) {
+            return;
+        }
+        {
+            std::lock_guard lk(mut);
+            for (auto &data : batch) {
+                dataQueue.push(std::move(data));
+            }
+        }
+        // one element can be consumed by one thread, more elements may keep several threads busy
+        if (batch.size() == 1) {
+            dataCond.notify_one();
+        } else {
+            dataCond.notify_all();
+        }
+    }
+
+    /**
+     * Moves at most [max] values from the front of the queue to [out] without waiting.
+     * @return number of values written to [out].
+     */
+    template<typename OutputIterator>
+    std::size_t PopUpTo(OutputIterator out, std::size_t max) {
+        std::vector<std::shared_ptr<T>> batch;
+        {
+            std::lock_guard lk(mut);
+            TakeBatch(batch, max);
+        }
+        // values are moved out after the lock is released
+        for (auto &data : batch) {
+            *out = std::move(*data);
+            ++out;
+        }
+        return batch.size();
+    }
+
+    /**
+     * Waits up to [timeout] for the queue to become non-empty and then takes
+     * at most [max] values from it under a single lock.
+     * @return popped values, empty if the timeout expired before any value arrived
+     * or the queue has been closed and there is no more data.
+     */
+    template<typename Rep, typename Period>
+    std::vector<std::shared_ptr<T>> WaitAndPopBatch(std::size_t max,
+                                                    const std::chrono::duration<Rep, Period> &timeout) {
+        std::vector<std::shared_ptr<T>> batch;
+        std::unique_lock lk(mut);
+        if (dataCond.wait_for(lk, timeout, [this] { return ReadyToPop(); })) {
+            TakeBatch(batch, max);
+        }
+        return batch;
+    }
+
+    /**
+     * Waits for a value to become available.
+     * @return false if the queue has been closed and there is no more data.
+     */
+    bool WaitAndPop(T &value) {
         std::unique_lock lk(mut);
-        dataCond.wait(lk, [this] { return !dataQueue.empty() });
+        dataCond.wait(lk, [this] { return ReadyToPop(); });
+        if (dataQueue.empty()) {
+            return false;
+        }
         value = std::move(*dataQueue.front());
         dataQueue.pop();
+        return true;
     }
 
+    /**
+     * @return value at the front of the queue or an empty pointer if the queue has been
+     * closed and there is no more data.
+     */
     std::shared_ptr<T> WaitAndPop() {
         // use unique lock because it allows to lock and unlock when necessary
         // lock_guard doesn't allow it.
         std::unique_lock lk(mut);
         // thread trying to pop an element from queue will sleep waiting for the
         // queue to be not empty any longer.
-        dataCond.wait(lk, [this] { return !dataQueue.empty() });
+        dataCond.wait(lk, [this] { return ReadyToPop(); });
+        if (dataQueue.empty()) {
+            return std::shared_ptr<T>();
+        }
+        std::shared_ptr<T> res = dataQueue.front();
+        dataQueue.pop();
+        return res;
+    }
+
+    /**
+     * Waits for a value until [deadline].
+     * @return false if the deadline has passed or the queue has been closed and there is no more data.
+     */
+    template<typename Clock, typename Duration>
+    bool WaitAndPopUntil(T &value, const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock lk(mut);
+        if (!dataCond.wait_until(lk, deadline, [this] { return ReadyToPop(); }) || dataQueue.empty()) {
+            return false;
+        }
+        value = std::move(*dataQueue.front());
+        dataQueue.pop();
+        return true;
+    }
+
+    template<typename Clock, typename Duration>
+    std::shared_ptr<T> WaitAndPopUntil(const std::chrono::time_point<Clock, Duration> &deadline) {
+        std::unique_lock lk(mut);
+        if (!dataCond.wait_until(lk, deadline, [this] { return ReadyToPop(); }) || dataQueue.empty()) {
+            return std::shared_ptr<T>();
+        }
         std::shared_ptr<T> res = dataQueue.front();
         dataQueue.pop();
         return res;
     }
 
+    template<typename Rep, typename Period>
+    bool WaitAndPopFor(T &value, const std::chrono::duration<Rep, Period> &timeout) {
+        return WaitAndPopUntil(value, std::chrono::steady_clock::now() + timeout);
+    }
+
+    template<typename Rep, typename Period>
+    std::shared_ptr<T> WaitAndPopFor(const std::chrono::duration<Rep, Period> &timeout) {
+        return WaitAndPopUntil(std::chrono::steady_clock::now() + timeout);
+    }
+
     bool TryPop(T &value) {
         std::lock_guard lk(mut);
         if (dataQueue.empty()) {
@@ -91,6 +236,23 @@ public:
         return res;
     }
 
+    /**
+     * Wakes up all waiting threads. Values that are already in the queue can still be
+     * popped, but once the queue is drained pops return an empty result instead of blocking.
+     */
+    void Close() {
+        {
+            std::lock_guard lk(mut);
+            closed = true;
+        }
+        dataCond.notify_all();
+    }
+
+    bool IsClosed() const {
+        std::lock_guard lk(mut);
+        return closed;
+    }
+
     bool empty() const {
         std::lock_guard lk(mut);
         return dataQueue.empty();
@@ -0,0 +1,212 @@
+#pragma once
+
+#include "algorithm"
+#include "atomic"
+#include "cstddef"
+#include "cstdint"
+#include "mutex"
+#include "stdexcept"
+#include "thread"
+#include "utility"
+#include "vector"
+#include "chapter08/cache_line.h"
+
+/**
+ * Epoch based reclamation: a way to delete nodes of a lock free data structure that readers may
+ * still be looking at, which costs a reader far less than hazard pointers do. Instead of publishing
+ * every pointer it dereferences, a reader only announces, once per operation, the global epoch it
+ * has seen when it entered its critical section (epoch_guard).
+ *
+ * A writer that unlinks a node retires it together with the current global epoch. The global epoch
+ * moves forward only when every thread inside a critical section has announced the current epoch.
+ * A reader that could still see a node retired in epoch e has announced e or an earlier epoch,
+ * so once the global epoch reaches e + 2 all such readers have left and the node can be deleted.
+ *
+ * A reader that stays in its critical section for long blocks reclamation (but never other readers
+ * or writers), so critical sections should be short.
+ */
+namespace epoch_reclamation {
+    unsigned const max_threads = 100;
+
+    /**
+     * Every reader writes its record twice per critical section, so each record has a cache line
+     * of its own: readers on different cores never write to the same line.
+     */
+    struct alignas(cache_line_size) thread_record {
+        std::atomic<std::thread::id> id;
+        /**
+         * Epoch announced by the owner thread, 0 while it is outside a critical section.
+         */
+        std::atomic<std::uint64_t> epoch;
+    };
+
+    inline thread_record thread_records[max_threads];
+    inline std::atomic<std::uint64_t> global_epoch{1};
+
+    /**
+     * Claims a thread_record for the current thread, the same way hp_owner claims a hazard pointer.
+     */
+    class record_owner {
+        thread_record *record;
+    public:
+        record_owner() : record(nullptr) {
+            for (unsigned i = 0; i < max_threads; ++i) {
+                std::thread::id old_id;
+                if (thread_records[i].id.compare_exchange_strong(old_id, std::this_thread::get_id())) {
+                    record = &thread_records[i];
+                    break;
+                }
+            }
+            if (!record) {
+                throw std::runtime_error("No epoch records available");
+            }
+        }
+
+        record_owner(const record_owner &) = delete;
+
+        record_owner &operator=(const record_owner &) = delete;
+
+        thread_record &get() {
+            return *record;
+        }
+
+        ~record_owner() {
+            record->epoch.store(0);
+            record->id.store(std::thread::id());
+        }
+    };
+
+    inline thread_record &record_for_current_thread() {
+        thread_local static record_owner owner;
+        return owner.get();
+    }
+
+    /**
+     * Critical section of a reader: pointers loaded from the data structure while a guard exists
+     * stay valid until it is destroyed. Guards may be nested.
+     */
+    class epoch_guard {
+        thread_record &record;
+
+        static unsigned &depth() {
+            thread_local static unsigned nesting = 0;
+            return nesting;
+        }
+
+    public:
+        epoch_guard() : record(record_for_current_thread()) {
+            if (depth()++ == 0) {
+                record.epoch.store(global_epoch.load());
+                // the announcement has to be visible before any pointer of the data structure is read
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+            }
+        }
+
+        ~epoch_guard() {
+            if (--depth() == 0) {
+                record.epoch.store(0, std::memory_order_release);
+            }
+        }
+
+        epoch_guard(const epoch_guard &) = delete;
+
+        epoch_guard &operator=(const epoch_guard &) = delete;
+    };
+
+    struct retired_node {
+        void *data;
+        void (*deleter)(void *);
+        std::uint64_t epoch;
+    };
+
+    template<typename T>
+    void do_delete(void *p) {
+        delete static_cast<T *>(p);
+    }
+
+    /**
+     * Nodes waiting for deletion. Whatever is left at program exit is deleted then,
+     * when no reader can run any more.
+     */
+    struct retired_list {
+        std::vector<retired_node> nodes;
+
+        ~retired_list() {
+            for (const retired_node &node : nodes) {
+                node.deleter(node.data);
+            }
+        }
+    };
+
+    inline std::mutex retired_mutex;
+    inline retired_list retired_nodes;
+    /**
+     * Retirements since the last call to reclaim, guarded by retired_mutex.
+     */
+    inline std::size_t retired_since_reclaim = 0;
+
+    /**
+     * A writer only tries to advance the epoch and reclaim once in this many retirements, so that
+     * most retirements are a push onto the list rather than a scan of every thread record.
+     */
+    std::size_t const reclaim_interval = 64;
+
+    /**
+     * Moves the global epoch forward if every thread in a critical section has seen the current one.
+     */
+    inline void try_advance_epoch() {
+        std::uint64_t current = global_epoch.load();
+        for (unsigned i = 0; i < max_threads; ++i) {
+            const std::uint64_t announced = thread_records[i].epoch.load();
+            if (announced != 0 && announced != current) {
+                return;
+            }
+        }
+        global_epoch.compare_exchange_strong(current, current + 1);
+    }
+
+    /**
+     * Deletes the retired nodes that no reader can see any more.
+     */
+    inline void reclaim() {
+        try_advance_epoch();
+        const std::uint64_t current = global_epoch.load();
+        std::vector<retired_node> to_delete;
+        {
+            std::lock_guard<std::mutex> lock(retired_mutex);
+            std::vector<retired_node> &nodes = retired_nodes.nodes;
+            auto first_kept = std::partition(nodes.begin(), nodes.end(),
+                                             [current](const retired_node &node) {
+                                                 return node.epoch + 2 <= current;
+                                             });
+            to_delete.assign(nodes.begin(), first_kept);
+            nodes.erase(nodes.begin(), first_kept);
+        }
+        for (const retired_node &node : to_delete) {
+            node.deleter(node.data);
+        }
+    }
+
+    /**
+     * Hands a node that has been unlinked from the data structure over for deletion.
+     * The node is deleted once no reader can hold a pointer to it. Writers should call this
+     * after releasing their own locks, since it may reclaim a batch of nodes.
+     */
+    template<typename T>
+    void retire(T *data) {
+        // the unlinking store has to be visible before the epoch is read
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool reclaim_now;
+        {
+            std::lock_guard<std::mutex> lock(retired_mutex);
+            retired_nodes.nodes.push_back({data, &do_delete<T>, global_epoch.load()});
+            reclaim_now = ++retired_since_reclaim >= reclaim_interval;
+            if (reclaim_now) {
+                retired_since_reclaim = 0;
+            }
+        }
+        if (reclaim_now) {
+            reclaim();
+        }
+    }
+}
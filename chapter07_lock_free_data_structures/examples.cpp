@@ -0,0 +1,62 @@
+#include "thread"
+#include "vector"
+#include "atomic"
+#include "iostream"
+#include "chapter02/joining_thread.h"
+#include "chapter06_lock_based_data_structures/lookup_table_round.h"
+#include "chapter07_lock_free_data_structures/lock_free_queue_ref_count.h"
+#include "chapter07_lock_free_data_structures/rcu_lookup_table.h"
+#include "chapter07_lock_free_data_structures/split_ordered_lookup_table.h"
+
+/**
+ * Two producers and two consumers on the multi producer / multi consumer queue.
+ * @return true if every pushed value was popped exactly once: the number and the sum of the popped
+ * values match the pushed ones, and the queue is empty afterwards.
+ */
+bool queueRound(unsigned valuesPerProducer = 10000) {
+    refcount::lock_free_queue<int> queue;
+    std::atomic<unsigned> popped(0);
+    std::atomic<long> sum(0);
+    const unsigned total = 2 * valuesPerProducer;
+    {
+        std::vector<std::thread> threads;
+        join_threads joiner(threads);
+        for (unsigned p = 0; p < 2; ++p) {
+            threads.emplace_back([&queue, valuesPerProducer] {
+                for (unsigned i = 0; i < valuesPerProducer; ++i) {
+                    queue.push(static_cast<int>(i));
+                }
+            });
+        }
+        for (unsigned c = 0; c < 2; ++c) {
+            threads.emplace_back([&queue, &popped, &sum, total] {
+                while (popped.load() < total) {
+                    if (std::unique_ptr<int> value = queue.pop()) {
+                        sum += *value;
+                        ++popped;
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            });
+        }
+    }
+    const long expectedSum = static_cast<long>(valuesPerProducer) * (valuesPerProducer - 1);
+    return popped.load() == total && sum.load() == expectedSum && !queue.pop();
+}
+
+int mainChapter7() {
+    rcu_lookup_table<int, int> rcuTable;
+    const bool rcuPassed = checkLookupTableRound(rcuTable);
+    std::cout << "rcu_lookup_table: " << (rcuPassed ? "passed" : "FAILED")
+              << ", " << rcuTable.get_map().size() << " entries\n";
+
+    split_ordered_lookup_table<int, int> splitOrderedTable;
+    const bool splitOrderedPassed = checkLookupTableRound(splitOrderedTable);
+    std::cout << "split_ordered_lookup_table: " << (splitOrderedPassed ? "passed" : "FAILED")
+              << ", " << splitOrderedTable.get_map().size() << " entries\n";
+
+    const bool queuePassed = queueRound();
+    std::cout << "lock_free_queue: " << (queuePassed ? "passed" : "FAILED") << '\n';
+    return rcuPassed && splitOrderedPassed && queuePassed ? 0 : 1;
+}
@@ -5,14 +5,23 @@
 #include "thread"
 #include "stdexcept"
 #include "functional"
+#include "algorithm"
+#include "vector"
 
-unsigned const max_hazard_pointers = 100;
+/**
+ * Number of threads that can hold hazard pointers at the same time. A thread can own the single
+ * hazard pointer of get_hazard_pointer_for_current_thread() and the max_hazard_pointers_per_thread
+ * indexed ones, so the table has room for all of them for every thread.
+ */
+unsigned const max_hazard_pointer_threads = 100;
+unsigned const max_hazard_pointers_per_thread = 4;
+unsigned const max_hazard_pointers = max_hazard_pointer_threads * (max_hazard_pointers_per_thread + 1);
 struct hazard_pointer {
     std::atomic<std::thread::id> id;
     std::atomic<void *> pointer;
 };
 
-hazard_pointer hazard_pointers[max_hazard_pointers];
+inline hazard_pointer hazard_pointers[max_hazard_pointers];
 
 class hp_owner {
     hazard_pointer *hp;
@@ -43,7 +52,7 @@ public:
 
     ~hp_owner() {
         hp->pointer.store(nullptr);
-        hp->id.store(std::thread::id);
+        hp->id.store(std::thread::id());
     }
 };
 
@@ -59,13 +68,27 @@ public:
  * pointers, so you throw an exception.
  * @return
  */
-std::atomic<void *> &get_hazard_pointer_for_current_thread() {
+inline std::atomic<void *> &get_hazard_pointer_for_current_thread() {
     // each thread has its own hazard pointer
     thread_local static hp_owner hazard;
     return hazard.get_pointer();
 }
 
-bool outstanding_hazard_pointers_for(void *p) {
+/**
+ * For data structures that have to protect several nodes at once, e.g. the previous and the current
+ * node of a linked list traversal. Every index is a separate hazard pointer, claimed the first time
+ * the thread asks for it, in the same way as above.
+ * @param index less than max_hazard_pointers_per_thread.
+ */
+inline std::atomic<void *> &get_hazard_pointer_for_current_thread(unsigned index) {
+    thread_local static std::unique_ptr<hp_owner> hazards[max_hazard_pointers_per_thread];
+    if (!hazards[index]) {
+        hazards[index].reset(new hp_owner);
+    }
+    return hazards[index]->get_pointer();
+}
+
+inline bool outstanding_hazard_pointers_for(void *p) {
     for (unsigned i = 0; i < max_hazard_pointers; ++i) {
         if (hazard_pointers[i].pointer.load() == p) {
             return true;
@@ -77,12 +100,12 @@ bool outstanding_hazard_pointers_for(void *p) {
 template<typename T>
 void do_delete(void *p) {
     // delete can handle only real pointer types not void* so that's why use static_cast
-    delete static_cast<T *>(p)
+    delete static_cast<T *>(p);
 }
 
 struct data_to_reclaim {
     void *data;
-    std::function<void < (void * )> deleter;
+    std::function<void(void *)> deleter;
     data_to_reclaim *next;
 
     template<class T>
@@ -91,14 +114,19 @@ struct data_to_reclaim {
             deleter(&do_delete<T>),
             next(nullptr) {};
 
+    data_to_reclaim(void *data_, void (*deleter_)(void *)) :
+            data(data_),
+            deleter(deleter_),
+            next(nullptr) {};
+
     ~data_to_reclaim() {
-        deleter(data)
+        deleter(data);
     }
 };
 
-std::atomic<data_to_reclaim *> nodes_to_reclaim;
+inline std::atomic<data_to_reclaim *> nodes_to_reclaim;
 
-void add_to_reclaim_list(data_to_reclaim *node) {
+inline void add_to_reclaim_list(data_to_reclaim *node) {
     node->next = nodes_to_reclaim.load();
     while (!nodes_to_reclaim.compare_exchange_weak(node->next, node));
 }
@@ -108,7 +136,7 @@ void reclaim_later(T *data) {
     add_to_reclaim_list(new data_to_reclaim(data));
 }
 
-void delete_nodes_with_no_hazards() {
+inline void delete_nodes_with_no_hazards() {
     // This simple but crucial step ensures that this is the only thread trying
     // to reclaim this particular set of nodes.
     data_to_reclaim *current = nodes_to_reclaim.exchange(nullptr);
@@ -123,3 +151,74 @@ void delete_nodes_with_no_hazards() {
     }
 }
 
+/**
+ * Number of nodes a thread retires with reclaim_in_batches() before it scans the hazard pointers.
+ * With twice as many retired nodes as there are hazard pointers, at least half of them can be
+ * deleted by every scan, so the cost of reading the whole table is spread over many nodes.
+ */
+std::size_t const hazard_scan_threshold = 2 * max_hazard_pointers;
+
+struct retired_pointer {
+    void *data;
+    void (*deleter)(void *);
+};
+
+/**
+ * Deletes the nodes that no hazard pointer points to and removes them from [nodes]. The hazard
+ * pointers are read once, into a sorted copy, so every node costs a binary search instead of a
+ * pass over the whole table.
+ */
+inline void delete_unprotected(std::vector<retired_pointer> &nodes) {
+    std::vector<void *> hazards;
+    hazards.reserve(max_hazard_pointers);
+    for (unsigned i = 0; i < max_hazard_pointers; ++i) {
+        if (void *const p = hazard_pointers[i].pointer.load()) {
+            hazards.push_back(p);
+        }
+    }
+    std::sort(hazards.begin(), hazards.end());
+    const auto first_kept = std::partition(nodes.begin(), nodes.end(), [&hazards](const retired_pointer &node) {
+        return !std::binary_search(hazards.begin(), hazards.end(), node.data);
+    });
+    const std::vector<retired_pointer> to_delete(nodes.begin(), first_kept);
+    nodes.erase(nodes.begin(), first_kept);
+    for (const retired_pointer &node : to_delete) {
+        node.deleter(node.data);
+    }
+}
+
+/**
+ * Nodes retired by one thread. When the thread exits, the nodes that are still protected are handed
+ * over to nodes_to_reclaim, to be deleted by a later scan of another thread.
+ */
+struct retired_batch {
+    std::vector<retired_pointer> nodes;
+
+    ~retired_batch() {
+        delete_unprotected(nodes);
+        for (const retired_pointer &node : nodes) {
+            add_to_reclaim_list(new data_to_reclaim(node.data, node.deleter));
+        }
+    }
+};
+
+inline std::vector<retired_pointer> &retired_by_current_thread() {
+    thread_local static retired_batch batch;
+    return batch.nodes;
+}
+
+/**
+ * Hands a node that has been unlinked from the data structure over for deletion, like reclaim_later(),
+ * but without scanning the hazard pointers for every node: the node is kept on a list of the current
+ * thread, which is scanned once it holds hazard_scan_threshold nodes.
+ */
+template<typename T>
+void reclaim_in_batches(T *data) {
+    std::vector<retired_pointer> &nodes = retired_by_current_thread();
+    nodes.push_back({data, &do_delete<T>});
+    if (nodes.size() >= hazard_scan_threshold) {
+        delete_unprotected(nodes);
+        // nodes left behind by threads that have exited
+        delete_nodes_with_no_hazards();
+    }
+}
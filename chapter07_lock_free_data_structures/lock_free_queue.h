@@ -3,6 +3,13 @@
 #include "atomic"
 #include "memory"
 
+/**
+ * Lock free queue that is safe only for a single producer thread and a single consumer thread:
+ * head and tail are updated with plain stores. For multiple producers and consumers
+ * use refcount::lock_free_queue from lock_free_queue_ref_count.h.
+ *
+ * @tparam T
+ */
 template<typename T>
 class lock_free_queue {
 private:
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "atomic"
+#include "cstdint"
+#include "memory"
+
+namespace refcount {
+    /**
+     * Lock free multi producer / multi consumer queue (Michael-Scott style) that uses the split
+     * reference count technique from refcount::lock_free_stack to decide when a node can be deleted.
+     *
+     * lock_free_queue works only for a single producer and a single consumer, because
+     * push() and pop() update tail and head with plain stores. Here both pointers are
+     * counted_node_ptr values updated with compare_exchange, and every thread that reads
+     * one of them first increases its external count, so a node can't be deleted while
+     * somebody still dereferences it.
+     *
+     * Unlike the stack, a node in the queue is referenced from two places: the tail pointer
+     * (or the next pointer of the previous node) and the head pointer. That's why each node
+     * keeps, together with the internal count, the number of external counters that still
+     * reference it (external_counters). The node is deleted only when both the internal count
+     * and the number of external counters drop to zero.
+     *
+     * push() first claims the dummy tail node by setting its data pointer with compare_exchange.
+     * If another thread has already claimed it, instead of spinning until that thread updates
+     * the tail, the current thread helps: it links a new dummy node after the tail itself
+     * and moves the tail forward, so a thread that was suspended in the middle of a push
+     * can't block the other threads.
+     *
+     * std::atomic<counted_node_ptr> is 16 bytes wide; with GCC its operations are implemented
+     * in libatomic, so programs using the queue have to link with -latomic.
+     *
+     * @tparam T
+     */
+    template<typename T>
+    class lock_free_queue {
+    private:
+        struct node;
+
+        /**
+         * External count is wrapped together with the node pointer. The count has the
+         * same width as the pointer, so the struct has no padding bytes that could make
+         * compare_exchange fail on otherwise equal values.
+         */
+        struct counted_node_ptr {
+            std::intptr_t external_count;
+            node *ptr;
+        };
+
+        /**
+         * Internal count and the number of external counters (at most 2: head/tail and
+         * the next pointer of the previous node) are kept together, so both can be
+         * updated by a single compare_exchange. The struct fits into a machine word,
+         * so std::atomic<node_counter> is lock free on common platforms.
+         */
+        struct node_counter {
+            unsigned internal_count: 30;
+            unsigned external_counters: 2;
+        };
+
+        struct node {
+            /**
+             * Pointer to the data is atomic, because push() claims a node by setting it
+             * with compare_exchange. Once set, it is never reset, so a node can be claimed only once.
+             */
+            std::atomic<T *> data;
+            std::atomic<node_counter> count;
+            std::atomic<counted_node_ptr> next;
+
+            node() : data(nullptr) {
+                node_counter new_count;
+                new_count.internal_count = 0;
+                // the node is referenced from tail (or the previous node's next) and will be from head
+                new_count.external_counters = 2;
+                count.store(new_count);
+
+                counted_node_ptr next_node;
+                next_node.external_count = 0;
+                next_node.ptr = nullptr;
+                next.store(next_node);
+            }
+
+            /**
+             * Called by a thread that no longer accesses the node through a pointer
+             * it has read from head or tail.
+             */
+            void release_ref() {
+                node_counter old_counter = count.load(std::memory_order_relaxed);
+                node_counter new_counter;
+                do {
+                    new_counter = old_counter;
+                    --new_counter.internal_count;
+                } while (!count.compare_exchange_strong(old_counter, new_counter,
+                                                        std::memory_order_acq_rel,
+                                                        std::memory_order_relaxed));
+                if (!new_counter.internal_count && !new_counter.external_counters) {
+                    delete this;
+                }
+            }
+        };
+
+        std::atomic<counted_node_ptr> head;
+        std::atomic<counted_node_ptr> tail;
+
+        static counted_node_ptr empty_counted_node_ptr() {
+            counted_node_ptr res;
+            res.external_count = 0;
+            res.ptr = nullptr;
+            return res;
+        }
+
+        /**
+         * Increases the external count of [counter] before the node it points to is dereferenced.
+         * On return [old_counter] holds the value that has been stored.
+         */
+        static void increase_external_count(std::atomic<counted_node_ptr> &counter,
+                                            counted_node_ptr &old_counter) {
+            counted_node_ptr new_counter;
+            do {
+                new_counter = old_counter;
+                ++new_counter.external_count;
+            } while (!counter.compare_exchange_strong(old_counter, new_counter,
+                                                      std::memory_order_acquire,
+                                                      std::memory_order_relaxed));
+            old_counter.external_count = new_counter.external_count;
+        }
+
+        /**
+         * Called when [old_node_ptr] is no longer stored in head or tail. Moves its external
+         * count into the node's internal count and drops one of the node's external counters.
+         */
+        static void free_external_counter(counted_node_ptr &old_node_ptr) {
+            node *const ptr = old_node_ptr.ptr;
+            // the pointer is no longer stored in the queue, that's -1,
+            // and this thread no longer accesses the node, that's -1 as well
+            const int count_increase = static_cast<int>(old_node_ptr.external_count) - 2;
+            node_counter old_counter = ptr->count.load(std::memory_order_relaxed);
+            node_counter new_counter;
+            do {
+                new_counter = old_counter;
+                --new_counter.external_counters;
+                new_counter.internal_count += count_increase;
+            } while (!ptr->count.compare_exchange_strong(old_counter, new_counter,
+                                                         std::memory_order_acq_rel,
+                                                         std::memory_order_relaxed));
+            if (!new_counter.internal_count && !new_counter.external_counters) {
+                delete ptr;
+            }
+        }
+
+        /**
+         * Moves tail from [old_tail] to [new_tail]. Another thread may be helping and
+         * move the tail first, so compare_exchange is retried only while tail still
+         * points to the same node. Whoever actually moved the tail frees its external counter,
+         * everybody else just releases the reference taken in push().
+         */
+        void set_new_tail(counted_node_ptr &old_tail, const counted_node_ptr &new_tail) {
+            node *const current_tail_ptr = old_tail.ptr;
+            while (!tail.compare_exchange_weak(old_tail, new_tail) &&
+                   old_tail.ptr == current_tail_ptr);
+            if (old_tail.ptr == current_tail_ptr) {
+                free_external_counter(old_tail);
+            } else {
+                current_tail_ptr->release_ref();
+            }
+        }
+
+    public:
+        lock_free_queue() {
+            counted_node_ptr dummy;
+            dummy.external_count = 1;
+            dummy.ptr = new node;
+            head.store(dummy);
+            tail.store(dummy);
+        }
+
+        ~lock_free_queue() {
+            while (pop());
+            delete head.load().ptr;
+        }
+
+        lock_free_queue(const lock_free_queue &) = delete;
+
+        lock_free_queue &operator=(const lock_free_queue &) = delete;
+
+        std::unique_ptr<T> pop() {
+            counted_node_ptr old_head = head.load(std::memory_order_relaxed);
+            for (;;) {
+                increase_external_count(head, old_head);
+                node *const ptr = old_head.ptr;
+                if (ptr == tail.load().ptr) {
+                    // the queue is empty, drop the reference we have just taken
+                    ptr->release_ref();
+                    return std::unique_ptr<T>();
+                }
+                counted_node_ptr next = ptr->next.load();
+                if (head.compare_exchange_strong(old_head, next)) {
+                    // we own the node now, take the data out of it. The data pointer is
+                    // deliberately not reset to nullptr: a pusher that is still holding a stale
+                    // tail pointing to this node would otherwise claim it and its value would be lost.
+                    T *const res = ptr->data.load();
+                    free_external_counter(old_head);
+                    return std::unique_ptr<T>(res);
+                }
+                // another thread moved head before us, release the node and try again
+                ptr->release_ref();
+            }
+        }
+
+        void push(T new_value) {
+            std::unique_ptr<T> new_data(new T(std::move(new_value)));
+            counted_node_ptr new_next = empty_counted_node_ptr();
+            new_next.external_count = 1;
+            counted_node_ptr old_tail = tail.load();
+            for (;;) {
+                // allocate the spare node before taking a reference to the tail node, so a failed
+                // allocation leaves the queue intact and holds no reference that would never be released
+                if (!new_next.ptr) {
+                    new_next.ptr = new node;
+                }
+                increase_external_count(tail, old_tail);
+                T *old_data = nullptr;
+                if (old_tail.ptr->data.compare_exchange_strong(old_data, new_data.get())) {
+                    // we have claimed the tail node, link the new dummy node after it.
+                    // Another thread may have already done it while helping us.
+                    counted_node_ptr old_next = empty_counted_node_ptr();
+                    if (!old_tail.ptr->next.compare_exchange_strong(old_next, new_next)) {
+                        delete new_next.ptr;
+                        new_next = old_next;
+                    }
+                    set_new_tail(old_tail, new_next);
+                    new_data.release();
+                    break;
+                } else {
+                    // another thread has claimed the tail node but hasn't moved the tail yet.
+                    // Help it by linking our spare node and moving the tail, then try again.
+                    counted_node_ptr old_next = empty_counted_node_ptr();
+                    if (old_tail.ptr->next.compare_exchange_strong(old_next, new_next)) {
+                        old_next = new_next;
+                        // our spare node is now part of the queue, another one is allocated on the next try
+                        new_next.ptr = nullptr;
+                    }
+                    set_new_tail(old_tail, old_next);
+                }
+            }
+        }
+    };
+}
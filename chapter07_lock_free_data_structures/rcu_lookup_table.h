@@ -0,0 +1,161 @@
+#pragma once
+
+#include "algorithm"
+#include "atomic"
+#include "functional"
+#include "map"
+#include "memory"
+#include "mutex"
+#include "utility"
+#include "vector"
+#include "epoch_reclamation.h"
+#include "chapter08/cache_line.h"
+
+/**
+ * Read mostly variant of thread_safe_lookup_table with the same operations. Readers never lock
+ * and never write to memory shared with other readers, so read throughput scales with the number
+ * of cores; writers pay for that with a copy of the bucket they modify (read-copy-update).
+ *
+ * Every bucket points to an immutable vector of its entries. A reader enters an epoch_guard, loads
+ * the pointer and searches the vector. A writer locks the bucket's mutex (writers to the same bucket
+ * are serialized, readers are not affected), copies the vector, modifies the copy and publishes it
+ * by storing the new pointer. The old vector is retired: epoch based reclamation deletes it once
+ * no reader that could have loaded it is still in its critical section.
+ *
+ * The number of buckets is fixed at construction time, and writes copy a whole bucket, so the table
+ * suits data that is read far more often than modified, e.g. configuration or routing tables.
+ *
+ * @tparam Key
+ * @tparam Value
+ * @tparam Hash
+ */
+template<typename Key, typename Value, typename Hash=std::hash<Key>>
+class rcu_lookup_table {
+private:
+
+    struct alignas(cache_line_size) bucket_type {
+        using bucket_value = std::pair<Key, Value>;
+        using bucket_data = std::vector<bucket_value>;
+
+        std::atomic<const bucket_data *> data;
+        // serializes writers of this bucket
+        std::mutex write_mutex;
+
+        bucket_type() : data(new bucket_data) {}
+
+        ~bucket_type() {
+            delete data.load(std::memory_order_relaxed);
+        }
+
+        static typename bucket_data::const_iterator find_entry_for(const bucket_data &entries, const Key &key) {
+            return std::find_if(entries.begin(), entries.end(),
+                                [&](const bucket_value &item) {
+                                    return item.first == key;
+                                });
+        }
+
+        /**
+         * Must be called inside an epoch_guard.
+         */
+        Value value_for(const Key &key, const Value &default_value) const {
+            const bucket_data *entries = data.load(std::memory_order_acquire);
+            const auto found_entry = find_entry_for(*entries, key);
+            return (found_entry == entries->end()) ? default_value : found_entry->second;
+        }
+
+        /**
+         * Replaces the entries with a modified copy made by [update], unless it returns false.
+         */
+        template<typename Update>
+        void modify(Update update) {
+            const bucket_data *old_entries;
+            {
+                std::lock_guard<std::mutex> lock(write_mutex);
+                // only writers replace the pointer, and they hold the lock, so the vector can't go away here
+                old_entries = data.load(std::memory_order_relaxed);
+                std::unique_ptr<bucket_data> new_entries(new bucket_data(*old_entries));
+                if (!update(*new_entries)) {
+                    return;
+                }
+                data.store(new_entries.release(), std::memory_order_release);
+            }
+            // retired outside the lock, so other writers of the bucket don't wait for a reclamation
+            epoch_reclamation::retire(const_cast<bucket_data *>(old_entries));
+        }
+
+        void add_or_update_mapping(const Key &key, const Value &value) {
+            modify([&](bucket_data &entries) {
+                const auto found_entry = std::find_if(entries.begin(), entries.end(),
+                                                      [&](const bucket_value &item) {
+                                                          return item.first == key;
+                                                      });
+                if (found_entry == entries.end()) {
+                    entries.push_back(bucket_value{key, value});
+                } else {
+                    found_entry->second = value;
+                }
+                return true;
+            });
+        }
+
+        void remove_mapping(const Key &key) {
+            modify([&](bucket_data &entries) {
+                const auto found_entry = find_entry_for(entries, key);
+                if (found_entry == entries.end()) {
+                    return false;
+                }
+                entries.erase(found_entry);
+                return true;
+            });
+        }
+    };
+
+    std::unique_ptr<bucket_type[]> buckets;
+    const std::size_t bucket_count;
+    Hash hasher;
+
+    bucket_type &get_bucket(const Key &key) const {
+        return buckets[hasher(key) % bucket_count];
+    }
+
+public:
+    using key_type = Key;
+    using mapped_value = Value;
+    using hash_type = Hash;
+
+    explicit rcu_lookup_table(unsigned num_buckets = 19, const Hash &hasher_ = Hash()) :
+            buckets(new bucket_type[num_buckets ? num_buckets : 1]),
+            bucket_count(num_buckets ? num_buckets : 1),
+            hasher(hasher_) {}
+
+    rcu_lookup_table(const rcu_lookup_table &) = delete;
+
+    rcu_lookup_table &operator=(const rcu_lookup_table &) = delete;
+
+    Value value_for(const Key &key, const Value &default_value = Value()) const {
+        epoch_reclamation::epoch_guard guard;
+        return get_bucket(key).value_for(key, default_value);
+    }
+
+    void add_or_update_mapping(const Key &key, const Value &value) {
+        get_bucket(key).add_or_update_mapping(key, value);
+    }
+
+    void remove_mapping(const Key &key) {
+        get_bucket(key).remove_mapping(key);
+    }
+
+    /**
+     * Every bucket is copied as one consistent version, but writes to different buckets
+     * that run during the copy may or may not be included.
+     */
+    std::map<Key, Value> get_map() const {
+        epoch_reclamation::epoch_guard guard;
+        std::map<Key, Value> res;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            const auto *entries = buckets[i].data.load(std::memory_order_acquire);
+            res.insert(entries->begin(), entries->end());
+        }
+        return res;
+    }
+};
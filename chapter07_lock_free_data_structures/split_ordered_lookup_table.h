@@ -0,0 +1,411 @@
+#pragma once
+
+#include "atomic"
+#include "cstdint"
+#include "functional"
+#include "map"
+#include "memory"
+#include "utility"
+#include "hazard_pointer.h"
+
+/**
+ * Lock free lookup table with the same operations as thread_safe_lookup_table: a split ordered list
+ * hash table (Shalev and Shavit). All entries are kept in one lock free sorted linked list
+ * (Harris and Michael), and the buckets are only shortcuts into it, so growing the table never moves
+ * an entry: doubling the number of buckets just adds shortcuts.
+ *
+ * The list is sorted by the bit reversed hash (the "split order"). The entries of a bucket are then
+ * contiguous, and when the number of buckets doubles, bucket b splits into b and b + n at a point that
+ * is already in the list. Every bucket starts with a dummy node, inserted the first time the bucket is
+ * used, right after the dummy of its parent bucket (b with the highest bit cleared). Dummy nodes have
+ * even order keys and entries odd ones, so a dummy always precedes the entries of its bucket.
+ *
+ * An entry is removed in two steps: it is first marked as deleted by setting the lowest bit of its
+ * next pointer, and then unlinked. A traversal unlinks every marked node it comes across. Nodes are
+ * protected by three hazard pointers per thread (previous, current and next node of the traversal),
+ * and unlinked nodes are reclaimed with hazard_pointer.h, in batches, so a write doesn't scan all the
+ * hazard pointers for the one node it has retired. Values are separate objects, replaced with an
+ * atomic exchange, so updating a value neither changes the list nor blocks readers; a reader protects
+ * the value it copies with a fourth hazard pointer.
+ *
+ * Dummy nodes and bucket segments are never deleted before the table is destroyed.
+ *
+ * Every thread that uses the table keeps four hazard pointers until it exits, so at most
+ * max_hazard_pointer_threads threads (hazard_pointer.h) can use hazard pointer based structures
+ * at the same time; beyond that, operations throw std::runtime_error.
+ *
+ * @tparam Key
+ * @tparam Value
+ * @tparam Hash
+ */
+template<typename Key, typename Value, typename Hash=std::hash<Key>>
+class split_ordered_lookup_table {
+private:
+    struct node {
+        const std::uint64_t order_key;
+        // the lowest bit is set once this node has been removed
+        std::atomic<node *> next;
+
+        explicit node(std::uint64_t order_key_) : order_key(order_key_), next(nullptr) {}
+
+        bool is_dummy() const {
+            return (order_key & 1) == 0;
+        }
+    };
+
+    struct entry_node : node {
+        const Key key;
+        std::atomic<Value *> value;
+
+        entry_node(std::uint64_t order_key_, const Key &key_, Value *value_) :
+                node(order_key_), key(key_), value(value_) {}
+
+        ~entry_node() {
+            delete value.load(std::memory_order_relaxed);
+        }
+    };
+
+    /**
+     * Result of a search: [current] is the node found, or the first node after the searched key,
+     * [previous] is the link pointing to it.
+     */
+    struct position {
+        std::atomic<node *> *previous;
+        node *current;
+        node *next;
+    };
+
+    enum hazard_pointer_index {
+        next_hazard = 0, current_hazard = 1, previous_hazard = 2, value_hazard = 3
+    };
+
+    static_assert(value_hazard < max_hazard_pointers_per_thread, "not enough hazard pointers per thread");
+
+    /**
+     * Clears the hazard pointers of the current thread when an operation is done with the list.
+     */
+    struct hazard_pointers_guard {
+        ~hazard_pointers_guard() {
+            for (unsigned i = 0; i <= value_hazard; ++i) {
+                get_hazard_pointer_for_current_thread(i).store(nullptr);
+            }
+        }
+    };
+
+    static constexpr std::size_t max_load_factor = 2;
+    static constexpr unsigned max_segments = 64;
+
+    /**
+     * Bucket b > 0 is in segment bit_width(b), which holds the buckets [2^(s-1), 2^s); bucket 0 is in
+     * segment 0. Segments are allocated when first used, so the bucket array grows without being copied.
+     */
+    mutable std::atomic<std::atomic<node *> *> segments[max_segments];
+    std::atomic<std::uint64_t> bucket_count;
+    std::atomic<std::size_t> entry_count;
+    node *const head;
+    Hash hasher;
+
+    static bool is_marked(node *p) {
+        return reinterpret_cast<std::uintptr_t>(p) & 1;
+    }
+
+    static node *marked(node *p) {
+        return reinterpret_cast<node *>(reinterpret_cast<std::uintptr_t>(p) | 1);
+    }
+
+    static node *unmarked(node *p) {
+        return reinterpret_cast<node *>(reinterpret_cast<std::uintptr_t>(p) & ~std::uintptr_t(1));
+    }
+
+    static std::uint64_t reverse_bits(std::uint64_t v) {
+        v = ((v >> 1) & 0x5555555555555555ull) | ((v & 0x5555555555555555ull) << 1);
+        v = ((v >> 2) & 0x3333333333333333ull) | ((v & 0x3333333333333333ull) << 2);
+        v = ((v >> 4) & 0x0f0f0f0f0f0f0f0full) | ((v & 0x0f0f0f0f0f0f0f0full) << 4);
+        v = ((v >> 8) & 0x00ff00ff00ff00ffull) | ((v & 0x00ff00ff00ff00ffull) << 8);
+        v = ((v >> 16) & 0x0000ffff0000ffffull) | ((v & 0x0000ffff0000ffffull) << 16);
+        return (v >> 32) | (v << 32);
+    }
+
+    static std::uint64_t entry_order_key(std::uint64_t hash) {
+        return reverse_bits(hash | (std::uint64_t(1) << 63));
+    }
+
+    static std::uint64_t dummy_order_key(std::uint64_t bucket) {
+        return reverse_bits(bucket);
+    }
+
+    static unsigned bit_width(std::uint64_t v) {
+        unsigned width = 0;
+        for (; v; v >>= 1) {
+            ++width;
+        }
+        return width;
+    }
+
+    template<typename T>
+    static void retire(T *p) {
+        reclaim_in_batches(p);
+    }
+
+    /**
+     * Copies the value of [entry], which must be protected by a hazard pointer.
+     */
+    static Value load_value(entry_node *entry) {
+        std::atomic<void *> &hp = get_hazard_pointer_for_current_thread(value_hazard);
+        Value *value = entry->value.load();
+        Value *temp;
+        // the same loop as in lock_free_stack: the value may be replaced and reclaimed before hp is set
+        do {
+            temp = value;
+            hp.store(value);
+            value = entry->value.load();
+        } while (value != temp);
+        return *value;
+    }
+
+    enum class search_result {
+        found, not_found, retry
+    };
+
+    /**
+     * One pass of the Harris-Michael search from [start], a dummy node, for the node with [order_key]
+     * (and [key], if it is an entry). Calls visit(entry) for every live entry it passes.
+     * Returns retry if another thread has changed the nodes it was looking at.
+     */
+    template<typename Visitor>
+    search_result search_once(node *start, std::uint64_t order_key, const Key *key, position &pos,
+                              Visitor &visit) const {
+        std::atomic<void *> &hp_next = get_hazard_pointer_for_current_thread(next_hazard);
+        std::atomic<void *> &hp_current = get_hazard_pointer_for_current_thread(current_hazard);
+        std::atomic<void *> &hp_previous = get_hazard_pointer_for_current_thread(previous_hazard);
+
+        // dummy nodes are never removed, so the start needs no hazard pointer
+        pos.previous = &start->next;
+        pos.current = pos.previous->load();
+        hp_current.store(pos.current);
+        if (pos.previous->load() != pos.current) {
+            return search_result::retry;
+        }
+        while (pos.current) {
+            pos.next = pos.current->next.load();
+            hp_next.store(unmarked(pos.next));
+            // the current node still links to next (so next hasn't been reclaimed),
+            // and it is still linked from previous (so it hasn't been removed)
+            if (pos.current->next.load() != pos.next || pos.previous->load() != pos.current) {
+                return search_result::retry;
+            }
+            if (is_marked(pos.next)) {
+                node *expected = pos.current;
+                if (!pos.previous->compare_exchange_strong(expected, unmarked(pos.next))) {
+                    return search_result::retry;
+                }
+                node *const removed = pos.current;
+                pos.current = unmarked(pos.next);
+                hp_current.store(pos.current);
+                retire(static_cast<entry_node *>(removed));
+                continue;
+            }
+            if (pos.current->order_key > order_key) {
+                return search_result::not_found;
+            }
+            if (pos.current->order_key == order_key &&
+                (pos.current->is_dummy() || (key && static_cast<entry_node *>(pos.current)->key == *key))) {
+                return search_result::found;
+            }
+            if (!pos.current->is_dummy()) {
+                visit(static_cast<entry_node *>(pos.current));
+            }
+            pos.previous = &pos.current->next;
+            hp_previous.store(pos.current);
+            pos.current = pos.next;
+            hp_current.store(pos.current);
+        }
+        return search_result::not_found;
+    }
+
+    template<typename Visitor>
+    bool find(node *start, std::uint64_t order_key, const Key *key, position &pos, Visitor visit) const {
+        search_result result;
+        while ((result = search_once(start, order_key, key, pos, visit)) == search_result::retry);
+        return result == search_result::found;
+    }
+
+    bool find(node *start, std::uint64_t order_key, const Key *key, position &pos) const {
+        return find(start, order_key, key, pos, [](entry_node *) {});
+    }
+
+    std::atomic<node *> &bucket_slot(std::uint64_t bucket) const {
+        const unsigned segment = bit_width(bucket);
+        const std::uint64_t first_in_segment = segment ? std::uint64_t(1) << (segment - 1) : 0;
+        std::atomic<node *> *buckets = segments[segment].load(std::memory_order_acquire);
+        if (!buckets) {
+            std::atomic<node *> *const new_buckets = new std::atomic<node *>[segment ? first_in_segment : 1]();
+            if (segments[segment].compare_exchange_strong(buckets, new_buckets, std::memory_order_acq_rel)) {
+                buckets = new_buckets;
+            } else {
+                delete[] new_buckets;
+            }
+        }
+        return buckets[bucket - first_in_segment];
+    }
+
+    /**
+     * Inserts the dummy node of [bucket] after the dummy of its parent bucket,
+     * unless another thread has already done it.
+     */
+    node *initialize_bucket(std::uint64_t bucket) const {
+        const std::uint64_t parent = bucket & ~(std::uint64_t(1) << (bit_width(bucket) - 1));
+        node *const parent_dummy = get_dummy(parent);
+        std::unique_ptr<node> dummy(new node(dummy_order_key(bucket)));
+        node *result;
+        position pos;
+        while (true) {
+            if (find(parent_dummy, dummy->order_key, nullptr, pos)) {
+                result = pos.current;
+                break;
+            }
+            dummy->next.store(pos.current);
+            if (pos.previous->compare_exchange_strong(pos.current, dummy.get())) {
+                result = dummy.release();
+                break;
+            }
+        }
+        bucket_slot(bucket).store(result, std::memory_order_release);
+        return result;
+    }
+
+    node *get_dummy(std::uint64_t bucket) const {
+        node *const dummy = bucket_slot(bucket).load(std::memory_order_acquire);
+        return dummy ? dummy : initialize_bucket(bucket);
+    }
+
+    node *get_bucket(std::uint64_t hash) const {
+        return get_dummy(hash & (bucket_count.load(std::memory_order_relaxed) - 1));
+    }
+
+    void grow_if_needed(std::size_t count) {
+        std::uint64_t current_count = bucket_count.load(std::memory_order_relaxed);
+        if (count > current_count * max_load_factor && current_count < (std::uint64_t(1) << 62)) {
+            // a failed exchange means another thread has grown the table
+            bucket_count.compare_exchange_strong(current_count, current_count * 2, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    using key_type = Key;
+    using mapped_value = Value;
+    using hash_type = Hash;
+
+    /**
+     * @param num_buckets initial number of buckets, rounded up to a power of two.
+     */
+    explicit split_ordered_lookup_table(unsigned num_buckets = 19, const Hash &hasher_ = Hash()) :
+            bucket_count(1), entry_count(0), head(new node(dummy_order_key(0))), hasher(hasher_) {
+        for (unsigned i = 0; i < max_segments; ++i) {
+            segments[i].store(nullptr, std::memory_order_relaxed);
+        }
+        bucket_slot(0).store(head, std::memory_order_relaxed);
+        std::uint64_t count = 1;
+        while (count < num_buckets) {
+            count <<= 1;
+        }
+        bucket_count.store(count, std::memory_order_relaxed);
+    }
+
+    split_ordered_lookup_table(const split_ordered_lookup_table &) = delete;
+
+    split_ordered_lookup_table &operator=(const split_ordered_lookup_table &) = delete;
+
+    ~split_ordered_lookup_table() {
+        node *current = head;
+        while (current) {
+            node *const next = unmarked(current->next.load(std::memory_order_relaxed));
+            if (current->is_dummy()) {
+                delete current;
+            } else {
+                delete static_cast<entry_node *>(current);
+            }
+            current = next;
+        }
+        for (unsigned i = 0; i < max_segments; ++i) {
+            delete[] segments[i].load(std::memory_order_relaxed);
+        }
+    }
+
+    Value value_for(const Key &key, const Value &default_value = Value()) const {
+        hazard_pointers_guard guard;
+        const std::uint64_t hash = hasher(key);
+        position pos;
+        if (!find(get_bucket(hash), entry_order_key(hash), &key, pos)) {
+            return default_value;
+        }
+        return load_value(static_cast<entry_node *>(pos.current));
+    }
+
+    void add_or_update_mapping(const Key &key, const Value &value) {
+        hazard_pointers_guard guard;
+        const std::uint64_t hash = hasher(key);
+        const std::uint64_t order_key = entry_order_key(hash);
+        node *const bucket = get_bucket(hash);
+        std::unique_ptr<Value> new_value(new Value(value));
+        std::unique_ptr<entry_node> new_entry;
+        position pos;
+        while (true) {
+            if (find(bucket, order_key, &key, pos)) {
+                if (new_entry) {
+                    new_value.reset(new_entry->value.exchange(nullptr));
+                }
+                Value *const old_value = static_cast<entry_node *>(pos.current)->value.exchange(new_value.release());
+                retire(old_value);
+                return;
+            }
+            if (!new_entry) {
+                new_entry.reset(new entry_node(order_key, key, new_value.release()));
+            }
+            new_entry->next.store(pos.current);
+            if (pos.previous->compare_exchange_strong(pos.current, new_entry.get())) {
+                new_entry.release();
+                grow_if_needed(entry_count.fetch_add(1, std::memory_order_relaxed) + 1);
+                return;
+            }
+        }
+    }
+
+    void remove_mapping(const Key &key) {
+        hazard_pointers_guard guard;
+        const std::uint64_t hash = hasher(key);
+        const std::uint64_t order_key = entry_order_key(hash);
+        node *const bucket = get_bucket(hash);
+        position pos;
+        while (find(bucket, order_key, &key, pos)) {
+            // logical removal: once next is marked, no other thread can insert after or remove this node
+            if (!pos.current->next.compare_exchange_strong(pos.next, marked(pos.next))) {
+                continue;
+            }
+            entry_count.fetch_sub(1, std::memory_order_relaxed);
+            node *expected = pos.current;
+            if (pos.previous->compare_exchange_strong(expected, pos.next)) {
+                get_hazard_pointer_for_current_thread(current_hazard).store(nullptr);
+                retire(static_cast<entry_node *>(pos.current));
+            } else {
+                // the list has changed, let a search unlink the node
+                find(bucket, order_key, &key, pos);
+            }
+            return;
+        }
+    }
+
+    /**
+     * Walks the whole list; entries added or removed during the walk may or may not be included.
+     */
+    std::map<Key, Value> get_map() const {
+        hazard_pointers_guard guard;
+        std::map<Key, Value> res;
+        position pos;
+        // a search that has to start over visits some entries again, the later value wins
+        find(head, ~std::uint64_t(0), nullptr, pos, [&res](entry_node *entry) {
+            res[entry->key] = load_value(entry);
+        });
+        return res;
+    }
+};
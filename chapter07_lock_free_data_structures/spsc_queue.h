@@ -0,0 +1,144 @@
+#pragma once
+
+#include "atomic"
+#include "cstddef"
+#include "memory"
+#include "new"
+#include "utility"
+#include "chapter08/cache_line.h"
+
+/**
+ * Wait-free bounded queue for exactly one producer thread and one consumer thread.
+ *
+ * Unlike lock_free_queue, values are stored inline in a ring buffer that is allocated
+ * once in the constructor, so push() and pop() never allocate or free memory.
+ *
+ * head is written only by the consumer and tail only by the producer. Each of them lives
+ * on its own cache line, so the two threads don't invalidate each other's lines on every
+ * operation. On top of that each side keeps a private cached copy of the other side's
+ * index: the producer only reloads head when its cached copy says the queue is full,
+ * and the consumer only reloads tail when its cached copy says the queue is empty. In the
+ * steady state this means a push or a pop touches no cache line written by the other thread,
+ * except for the slot itself.
+ *
+ * Indexes grow monotonically and are mapped onto the buffer with a mask, so the capacity
+ * is always a power of two.
+ *
+ * @tparam T type of values stored in the queue.
+ */
+template<typename T>
+class spsc_queue {
+private:
+
+    struct slot {
+        alignas(T) unsigned char storage[sizeof(T)];
+
+        T *value() {
+            return std::launder(reinterpret_cast<T *>(storage));
+        }
+    };
+
+    const std::size_t capacity;
+    const std::size_t mask;
+    std::unique_ptr<slot[]> buffer;
+
+    // consumer side: index of the next value to pop and the last tail it has seen
+    alignas(cache_line_size) std::atomic<std::size_t> head;
+    std::size_t cached_tail;
+
+    // producer side: index of the next free slot and the last head it has seen
+    alignas(cache_line_size) std::atomic<std::size_t> tail;
+    std::size_t cached_head;
+
+    static std::size_t round_up_to_power_of_two(std::size_t value) {
+        std::size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+public:
+    explicit spsc_queue(std::size_t requested_capacity) :
+            capacity(round_up_to_power_of_two(requested_capacity < 2 ? 2 : requested_capacity)),
+            mask(capacity - 1),
+            buffer(new slot[capacity]),
+            head(0),
+            cached_tail(0),
+            tail(0),
+            cached_head(0) {}
+
+    ~spsc_queue() {
+        const std::size_t last = tail.load(std::memory_order_relaxed);
+        for (std::size_t i = head.load(std::memory_order_relaxed); i != last; ++i) {
+            buffer[i & mask].value()->~T();
+        }
+    }
+
+    spsc_queue(const spsc_queue &) = delete;
+
+    spsc_queue &operator=(const spsc_queue &) = delete;
+
+    /**
+     * Constructs a value in place at the back of the queue. Must only be called
+     * from the producer thread.
+     * @return false if the queue is full.
+     */
+    template<typename ... Args>
+    bool emplace(Args &&... args) {
+        // only this thread writes tail, so a relaxed load sees our own last store
+        const std::size_t current_tail = tail.load(std::memory_order_relaxed);
+        if (current_tail - cached_head == capacity) {
+            // looks full, refresh our view of the consumer's progress
+            cached_head = head.load(std::memory_order_acquire);
+            if (current_tail - cached_head == capacity) {
+                return false;
+            }
+        }
+        new(buffer[current_tail & mask].storage) T(std::forward<Args>(args)...);
+        // release makes the constructed value visible to the consumer before the new tail
+        tail.store(current_tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T &new_value) {
+        return emplace(new_value);
+    }
+
+    bool push(T &&new_value) {
+        return emplace(std::move(new_value));
+    }
+
+    /**
+     * Moves the value at the front of the queue into [value]. Must only be called
+     * from the consumer thread.
+     * @return false if the queue is empty.
+     */
+    bool pop(T &value) {
+        const std::size_t current_head = head.load(std::memory_order_relaxed);
+        if (current_head == cached_tail) {
+            // looks empty, refresh our view of the producer's progress
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (current_head == cached_tail) {
+                return false;
+            }
+        }
+        T *const stored = buffer[current_head & mask].value();
+        value = std::move(*stored);
+        stored->~T();
+        // release hands the slot back to the producer only after we are done with it
+        head.store(current_head + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * May be called from either side, but the answer is only a snapshot.
+     */
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    std::size_t max_size() const {
+        return capacity;
+    }
+};
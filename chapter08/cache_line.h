@@ -0,0 +1,12 @@
+#pragma once
+
+#include "cstddef"
+
+/**
+ * Size of a cache line on the CPUs this code targets. Data written by different threads is aligned
+ * (and so padded) to it, so that the threads don't false share a line.
+ *
+ * std::hardware_destructive_interference_size would say the same, but not every standard library
+ * provides it, and its value may change between compiler versions.
+ */
+inline constexpr std::size_t cache_line_size = 64;
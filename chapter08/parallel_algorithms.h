@@ -0,0 +1,314 @@
+#pragma once
+
+#include "algorithm"
+#include "atomic"
+#include "cstddef"
+#include "exception"
+#include "functional"
+#include "future"
+#include "iterator"
+#include "numeric"
+#include "type_traits"
+#include "vector"
+#include "chapter08/cache_line.h"
+#include "chapter09_advanced_thread_management/thread_pool.h"
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+/**
+ * Data parallel algorithms running on a thread_pool, together with the chunking and exception
+ * propagation layer they share. Every algorithm splits its range into at most one block per worker
+ * of the pool plus one for the calling thread, and run_blocks() runs the blocks.
+ */
+
+/**
+ * Size of the L2 cache of the current CPU in bytes, or a typical size if the system can't tell.
+ */
+inline std::size_t l2_cache_size() {
+    static const std::size_t size = [] {
+        long bytes = 0;
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+        bytes = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#endif
+        return bytes > 0 ? static_cast<std::size_t>(bytes) : std::size_t(256 * 1024);
+    }();
+    return size;
+}
+
+/**
+ * Minimum size in bytes of a block of the memory bound algorithms (reductions, scans). Handing a block
+ * to a worker costs a few microseconds at most, about as long as reading this much memory.
+ */
+constexpr std::size_t min_bytes_per_block = 16 * 1024;
+
+/**
+ * Minimum block size of the memory bound algorithms, in elements.
+ */
+template<typename ValueType>
+std::size_t min_elements_per_block() {
+    return std::max<std::size_t>(1, min_bytes_per_block / sizeof(ValueType));
+}
+
+/**
+ * Maximum block size of the memory bound algorithms: as many elements as fill the L2 cache,
+ * so a block stays in the cache of the core working on it. Longer ranges get more blocks than threads.
+ */
+template<typename ValueType>
+std::size_t max_elements_per_block() {
+    return std::max(min_elements_per_block<ValueType>(), l2_cache_size() / sizeof(ValueType));
+}
+
+/**
+ * Minimum block size of the element wise algorithms (for_each, transform, find), whose cost
+ * per element depends on the function they call.
+ */
+constexpr std::size_t min_elements_per_task = 1024;
+
+/**
+ * A value on a cache line of its own. Per block results are stored in these, so that
+ * the workers writing them don't false share.
+ */
+template<typename T>
+struct alignas(cache_line_size) padded {
+    T value;
+};
+
+/**
+ * Number of blocks for a range of [length] elements: one for each worker of [pool] plus one
+ * for the calling thread, but none smaller than [min_per_block].
+ */
+inline std::size_t block_count(std::size_t length, std::size_t min_per_block, thread_pool &pool) {
+    const std::size_t max_blocks = (length + min_per_block - 1) / min_per_block;
+    return std::max<std::size_t>(1, std::min<std::size_t>(pool.size() + 1, max_blocks));
+}
+
+/**
+ * Same as above, but with more blocks if needed to keep all of them within [max_per_block].
+ */
+inline std::size_t block_count(std::size_t length, std::size_t min_per_block, std::size_t max_per_block,
+                               thread_pool &pool) {
+    const std::size_t min_blocks = (length + max_per_block - 1) / max_per_block;
+    return std::max(min_blocks, block_count(length, min_per_block, pool));
+}
+
+/**
+ * Splits the [length] elements starting at [first] into [num_blocks] blocks of nearly the same
+ * size and calls f(block_index, block_first, block_last) for each of them: the last block on the
+ * calling thread, the others as tasks on [pool]. The results of the tasks come back through
+ * the futures of their packaged tasks.
+ *
+ * When a block throws, the rest of the work is cancelled: blocks that haven't started yet are skipped,
+ * and blocks that accept a fourth parameter, f(block_index, block_first, block_last, cancelled),
+ * can poll the flag and stop early. The blocks usually write into the caller's local state,
+ * so all of them are waited for before the function returns. The first exception is then rethrown.
+ */
+template<typename Iterator, typename BlockFunction>
+void run_blocks(Iterator first, std::size_t length, std::size_t num_blocks, BlockFunction f, thread_pool &pool) {
+    std::atomic<bool> cancelled(false);
+    auto run_block = [&f, &cancelled](std::size_t i, Iterator block_first, Iterator block_last) {
+        if (cancelled.load(std::memory_order_relaxed)) {
+            return;
+        }
+        try {
+            if constexpr (std::is_invocable_v<BlockFunction &, std::size_t, Iterator, Iterator,
+                    const std::atomic<bool> &>) {
+                f(i, block_first, block_last, cancelled);
+            } else {
+                f(i, block_first, block_last);
+            }
+        } catch (...) {
+            cancelled.store(true, std::memory_order_relaxed);
+            throw;
+        }
+    };
+
+    std::vector<std::future<void>> futures(num_blocks - 1);
+    std::exception_ptr error;
+    try {
+        Iterator block_start = first;
+        std::size_t start_index = 0;
+        for (std::size_t i = 0; i < (num_blocks - 1); ++i) {
+            const std::size_t end_index = length * (i + 1) / num_blocks;
+            Iterator block_end = std::next(block_start, end_index - start_index);
+            futures[i] = pool.submit([&run_block, i, block_start, block_end] {
+                run_block(i, block_start, block_end);
+            });
+            block_start = block_end;
+            start_index = end_index;
+        }
+        run_block(num_blocks - 1, block_start, std::next(block_start, length - start_index));
+    } catch (...) {
+        cancelled.store(true, std::memory_order_relaxed);
+        error = std::current_exception();
+    }
+
+    for (auto &future : futures) {
+        if (!future.valid()) {
+            continue;
+        }
+        try {
+            // if the caller is itself a pool task, help with pending tasks instead of blocking a worker
+            pool.wait_for_result(future);
+        } catch (...) {
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+template<typename Iterator, typename Function>
+void parallel_for_each(Iterator first, Iterator last, Function f, thread_pool &pool = default_thread_pool()) {
+    const std::size_t length = std::distance(first, last);
+    if (!length) {
+        return;
+    }
+    const std::size_t num_blocks = block_count(length, min_elements_per_task, pool);
+    run_blocks(first, length, num_blocks, [&f](std::size_t, Iterator block_first, Iterator block_last,
+                                               const std::atomic<bool> &cancelled) {
+        // work in slices, so a failure in another block stops this one soon
+        std::size_t remaining = std::distance(block_first, block_last);
+        while (remaining && !cancelled.load(std::memory_order_relaxed)) {
+            const std::size_t slice = std::min(remaining, min_elements_per_task);
+            const Iterator slice_last = std::next(block_first, slice);
+            std::for_each(block_first, slice_last, f);
+            block_first = slice_last;
+            remaining -= slice;
+        }
+    }, pool);
+}
+
+/**
+ * Parallel std::transform. The output range may be the input range itself.
+ * @return end of the output range.
+ */
+template<typename InputIterator, typename OutputIterator, typename UnaryOperation>
+OutputIterator parallel_transform(InputIterator first, InputIterator last, OutputIterator d_first,
+                                  UnaryOperation op, thread_pool &pool = default_thread_pool()) {
+    const std::size_t length = std::distance(first, last);
+    if (!length) {
+        return d_first;
+    }
+    const std::size_t num_blocks = block_count(length, min_elements_per_task, pool);
+    run_blocks(first, length, num_blocks,
+               [first, d_first, &op](std::size_t, InputIterator block_first, InputIterator block_last,
+                                     const std::atomic<bool> &cancelled) {
+                   OutputIterator out = std::next(d_first, std::distance(first, block_first));
+                   std::size_t remaining = std::distance(block_first, block_last);
+                   while (remaining && !cancelled.load(std::memory_order_relaxed)) {
+                       const std::size_t slice = std::min(remaining, min_elements_per_task);
+                       const InputIterator slice_last = std::next(block_first, slice);
+                       out = std::transform(block_first, slice_last, out, op);
+                       block_first = slice_last;
+                       remaining -= slice;
+                   }
+               }, pool);
+    return std::next(d_first, length);
+}
+
+/**
+ * Parallel std::find_if: returns the first element satisfying [pred], or [last].
+ *
+ * The position of the first match found so far is shared by all blocks in an atomic variable.
+ * A block gives up as soon as it gets past that position, so once a match is found, blocks after
+ * it stop right away and only the blocks before it keep looking for an earlier one.
+ */
+template<typename Iterator, typename Predicate>
+Iterator parallel_find_if(Iterator first, Iterator last, Predicate pred, thread_pool &pool = default_thread_pool()) {
+    const std::size_t length = std::distance(first, last);
+    if (!length) {
+        return last;
+    }
+    std::atomic<std::size_t> first_match(length);
+    const std::size_t num_blocks = block_count(length, min_elements_per_task, pool);
+    run_blocks(first, length, num_blocks,
+               [first, &pred, &first_match](std::size_t, Iterator block_first, Iterator block_last,
+                                            const std::atomic<bool> &cancelled) {
+                   std::size_t position = std::distance(first, block_first);
+                   for (; block_first != block_last; ++block_first, ++position) {
+                       if (position >= first_match.load(std::memory_order_relaxed) ||
+                           cancelled.load(std::memory_order_relaxed)) {
+                           return;
+                       }
+                       if (pred(*block_first)) {
+                           std::size_t current = first_match.load(std::memory_order_relaxed);
+                           while (position < current &&
+                                  !first_match.compare_exchange_weak(current, position, std::memory_order_relaxed));
+                           return;
+                       }
+                   }
+               }, pool);
+    // run_blocks has waited for all blocks, so the final value is visible here
+    const std::size_t position = first_match.load(std::memory_order_relaxed);
+    return position == length ? last : std::next(first, position);
+}
+
+template<typename Iterator, typename T>
+Iterator parallel_find(Iterator first, Iterator last, const T &value, thread_pool &pool = default_thread_pool()) {
+    return parallel_find_if(first, last, [&value](const auto &element) { return element == value; }, pool);
+}
+
+/**
+ * Parallel std::partial_sum with a two pass block scan. [op] has to be associative.
+ * The output range may be the input range itself.
+ *  1. every block computes the sum of its elements;
+ *  2. the calling thread scans the (few) block sums, which gives each block the sum of all elements
+ *  before it, and every block writes the partial sums of its elements starting from that carry.
+ * Every element is read twice, but both passes are fully parallel.
+ * @return end of the output range.
+ */
+template<typename InputIterator, typename OutputIterator, typename BinaryOperation = std::plus<>>
+OutputIterator parallel_partial_sum(InputIterator first, InputIterator last, OutputIterator d_first,
+                                    BinaryOperation op = BinaryOperation(), thread_pool &pool = default_thread_pool()) {
+    using value_type = typename std::iterator_traits<InputIterator>::value_type;
+    const std::size_t length = std::distance(first, last);
+    if (!length) {
+        return d_first;
+    }
+    const std::size_t num_blocks = block_count(length, min_elements_per_block<value_type>(),
+                                               max_elements_per_block<value_type>(), pool);
+    if (num_blocks == 1) {
+        return std::partial_sum(first, last, d_first, op);
+    }
+
+    // pass 1: the sum of every block except the last one, nobody needs that one
+    std::vector<padded<value_type>> block_sums(num_blocks, padded<value_type>{*first});
+    run_blocks(first, length, num_blocks,
+               [num_blocks, &block_sums, &op](std::size_t block, InputIterator block_first, InputIterator block_last) {
+                   if (block == num_blocks - 1) {
+                       return;
+                   }
+                   value_type sum = *block_first;
+                   while (++block_first != block_last) {
+                       sum = op(std::move(sum), *block_first);
+                   }
+                   block_sums[block].value = std::move(sum);
+               }, pool);
+
+    // turn the block sums into carries: the sum of all elements before each block
+    for (std::size_t block = 2; block < num_blocks; ++block) {
+        block_sums[block - 1].value = op(block_sums[block - 2].value, block_sums[block - 1].value);
+    }
+
+    // pass 2
+    run_blocks(first, length, num_blocks,
+               [first, d_first, &block_sums, &op](std::size_t block, InputIterator block_first,
+                                                  InputIterator block_last) {
+                   OutputIterator out = std::next(d_first, std::distance(first, block_first));
+                   if (block == 0) {
+                       std::partial_sum(block_first, block_last, out, op);
+                       return;
+                   }
+                   value_type sum = block_sums[block - 1].value;
+                   for (; block_first != block_last; ++block_first, ++out) {
+                       sum = op(std::move(sum), *block_first);
+                       *out = sum;
+                   }
+               }, pool);
+    return std::next(d_first, length);
+}
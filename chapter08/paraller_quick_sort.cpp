@@ -3,38 +3,33 @@
 #include "thread"
 #include "list"
 #include "future"
-#include "chapter03/thread_safe_stack.h"
+#include "chapter09_advanced_thread_management/thread_pool.h"
 #include "algorithm"
+#include "atomic"
+#include "iostream"
+#include "random"
+#include "chapter02/joining_thread.h"
+#include "chapter08/work_stealing_deque.h"
 
 using namespace std;
 
+/**
+ * Parallel quick sort that distributes chunks between the worker threads of a thread pool.
+ *
+ * Every thread submits the lower part of the chunk it partitions as a new task and
+ * continues with the higher part. When the task is submitted from a worker thread it
+ * lands in that worker's own work stealing deque, so in the common case a thread works
+ * on its own data without touching any shared lock, and idle workers steal the oldest,
+ * usually the biggest, chunks from the others.
+ *
+ * While waiting for the lower part to be sorted a thread runs other pending tasks
+ * instead of blocking, so the pool can't deadlock with all workers waiting.
+ */
 template<typename T>
 struct sorter {
-    struct chunk_to_sort {
-        list<T> data;
-        promise<list<T>> promise;
-    };
-    ThreadSafeStack<chunk_to_sort> chunks;
-    vector<thread> threads;
-    const size_t max_thread_count;
-    atomic<bool> end_of_data;
-
-    sorter() : max_thread_count(thread::hardware_concurrency() - 1),
-    end_of_data(false) {};
-
-    ~sorter() {
-        end_of_data = true;
-        for (size_t i = 0; i < threads.size(); ++i) {
-            threads[i].join();
-        }
-    }
+    thread_pool &pool;
 
-    void try_sort_chunk() {
-        shared_ptr<chunk_to_sort> chunk = chunks.Pop();
-        if (chunk) {
-            sort_chunk(chunk);
-        }
-    }
+    explicit sorter(thread_pool &pool_) : pool(pool_) {}
 
     list<T> do_sort(list<T> &chunk_data) {
         if (chunk_data.empty()) {
@@ -47,41 +42,20 @@ struct sorter {
                 partition(chunk_data.begin(), chunk_data.end(),
                           [&](const T &val) { return val < partition_val; });
 
-        chunk_to_sort new_lower_chunk;
-        new_lower_chunk.data.splice(new_lower_chunk.data.end(),
-                                    chunk_data, chunk_data.begin(),
-                                    divide_point);
-        future<list<T>> new_lower =
-                new_lower_chunk.promise.get_future();
-
-        chunks.Push(move(new_lower_chunk));
-
-        if (threads.size() < max_thread_count) {
-            threads.push_back(thread(&sorter<T>::sort_thread, this));
-        }
+        list<T> new_lower_chunk;
+        new_lower_chunk.splice(new_lower_chunk.end(),
+                               chunk_data, chunk_data.begin(),
+                               divide_point);
+        future<list<T>> new_lower = pool.submit(
+                [this, data = move(new_lower_chunk)]() mutable { return do_sort(data); }
+        );
 
         list<T> new_higher(do_sort(chunk_data));
         result.splice(result.end(), new_higher);
 
-        while (new_lower.wait_for(std::chrono::seconds(0)) !=
-        future_status::ready) {
-            try_sort_chunk();
-        }
-
-        result.splice(result.begin(), new_lower.get());
+        result.splice(result.begin(), pool.wait_for_result(new_lower));
         return result;
     }
-
-    void sort_chunk(const shared_ptr<chunk_to_sort> &chunk) {
-        chunk->promise.set_value(do_sort(chunk->data));
-    }
-
-    void sort_thread() {
-        while (!end_of_data) {
-            try_sort_chunk();
-            this_thread::yield();
-        }
-    }
 };
 
 template<typename T>
@@ -89,40 +63,84 @@ list<T> parallel_quick_sort(list<T> input) {
     if (input.empty()) {
         return input;
     }
-    sorter<T> s;
+    sorter<T> s(default_thread_pool());
     return s.do_sort(input);
 }
 
+/**
+ * The owner pushes 0..numItems-1 into a deque with room for 4 items, in batches of 64, and pops half
+ * of every batch back, while [numThieves] threads steal from the top. The first batch is pushed before
+ * the thieves start, so the deque has to grow.
+ * @return true if every pushed item was taken exactly once, either by the owner or by a thief.
+ */
+bool workStealingDequeRound(unsigned numItems = 100000, unsigned numThieves = 3) {
+    work_stealing_deque<unsigned> deque(4);
+    vector<atomic<unsigned>> taken(numItems);
+    atomic<bool> done(false);
+    // an item that was never pushed, e.g. read from a slot being overwritten
+    atomic<bool> corrupted(false);
+    const auto take = [&taken, &corrupted, numItems](unsigned item) {
+        if (item < numItems) {
+            ++taken[item];
+        } else {
+            corrupted = true;
+        }
+    };
+    unsigned next = 0;
+    const auto pushBatch = [&deque, &next, numItems] {
+        for (unsigned i = 0; i < 64 && next < numItems; ++i) {
+            deque.push(next++);
+        }
+    };
+    pushBatch();
+    {
+        vector<thread> thieves;
+        join_threads joiner(thieves);
+        for (unsigned t = 0; t < numThieves; ++t) {
+            thieves.emplace_back([&deque, &done, &take] {
+                unsigned item;
+                while (!done.load()) {
+                    if (deque.steal(item)) {
+                        take(item);
+                    }
+                }
+            });
+        }
+        unsigned item;
+        while (next < numItems) {
+            for (unsigned i = 0; i < 32 && deque.pop(item); ++i) {
+                take(item);
+            }
+            pushBatch();
+        }
+        // a failed pop means the deque is empty: either nothing was left or a thief took the last item
+        while (deque.pop(item)) {
+            take(item);
+        }
+        done = true;
+    }
+    if (corrupted.load()) {
+        return false;
+    }
+    for (const atomic<unsigned> &count : taken) {
+        if (count.load() != 1) {
+            return false;
+        }
+    }
+    return true;
+}
 
+int mainChapter8() {
+    const bool dequePassed = workStealingDequeRound();
+    cout << "work_stealing_deque: " << (dequePassed ? "passed" : "FAILED") << '\n';
 
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
+    vector<int> values(10000);
+    for (unsigned i = 0; i < values.size(); ++i) {
+        values[i] = static_cast<int>(i);
+    }
+    shuffle(values.begin(), values.end(), mt19937(42));
+    const list<int> sorted = parallel_quick_sort(list<int>(values.begin(), values.end()));
+    const bool sortPassed = sorted.size() == values.size() && is_sorted(sorted.begin(), sorted.end());
+    cout << "parallel_quick_sort: " << (sortPassed ? "passed" : "FAILED") << '\n';
+    return dequePassed && sortPassed ? 0 : 1;
+}
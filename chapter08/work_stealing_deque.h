@@ -0,0 +1,176 @@
+#pragma once
+
+#include "atomic"
+#include "cstdint"
+#include "memory"
+#include "type_traits"
+#include "vector"
+#include "chapter08/cache_line.h"
+
+/**
+ * Lock free work stealing deque (Chase-Lev). The deque belongs to one owner thread,
+ * which pushes and pops items at the bottom, as if it was a stack. Any other thread
+ * may steal items from the top, i.e. it takes the oldest items, which in a divide
+ * and conquer algorithm are usually the biggest pieces of work.
+ *
+ * The owner and the thieves only compete with each other when there is one item left:
+ * in that case both sides try to move top with compare_exchange, and only one of them wins.
+ * Otherwise push() and pop() don't execute any read-modify-write operation at all.
+ *
+ * Items are stored in a circular array that grows when it is full. The old array can
+ * still be read by a thief that loaded the pointer to it before the owner replaced it,
+ * so old arrays are kept until the deque is destroyed.
+ *
+ * Thieves may read a slot at the same time as the owner overwrites it (the steal then fails),
+ * that's why every slot is atomic and T has to be trivially copyable. To store bigger
+ * objects, store pointers to them.
+ *
+ * @tparam T trivially copyable type of items, e.g. a pointer.
+ */
+template<typename T>
+class work_stealing_deque {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "work_stealing_deque can only store trivially copyable values");
+
+private:
+
+    struct circular_array {
+        const std::int64_t capacity;
+        const std::int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> items;
+
+        explicit circular_array(std::int64_t capacity_) :
+                capacity(capacity_), mask(capacity_ - 1), items(new std::atomic<T>[capacity_]) {}
+
+        T get(std::int64_t index) const {
+            return items[index & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(std::int64_t index, T value) {
+            items[index & mask].store(value, std::memory_order_relaxed);
+        }
+
+        /**
+         * Copies items in [top, bottom) into a new array twice as big.
+         */
+        circular_array *grow(std::int64_t bottom, std::int64_t top) const {
+            circular_array *const res = new circular_array(capacity * 2);
+            for (std::int64_t i = top; i != bottom; ++i) {
+                res->put(i, get(i));
+            }
+            return res;
+        }
+    };
+
+    // thieves modify top, only the owner modifies bottom
+    alignas(cache_line_size) std::atomic<std::int64_t> top;
+    alignas(cache_line_size) std::atomic<std::int64_t> bottom;
+    std::atomic<circular_array *> array;
+    /**
+     * Arrays replaced by grow(). Accessed only by the owner.
+     */
+    std::vector<std::unique_ptr<circular_array>> retired_arrays;
+
+public:
+    explicit work_stealing_deque(std::int64_t initial_capacity = 64) :
+            top(0), bottom(0) {
+        std::int64_t capacity = 1;
+        while (capacity < initial_capacity) {
+            capacity <<= 1;
+        }
+        array.store(new circular_array(capacity), std::memory_order_relaxed);
+    }
+
+    ~work_stealing_deque() {
+        delete array.load(std::memory_order_relaxed);
+    }
+
+    work_stealing_deque(const work_stealing_deque &) = delete;
+
+    work_stealing_deque &operator=(const work_stealing_deque &) = delete;
+
+    /**
+     * Adds an item at the bottom. Must only be called by the owner.
+     */
+    void push(T value) {
+        const std::int64_t b = bottom.load(std::memory_order_relaxed);
+        const std::int64_t t = top.load(std::memory_order_acquire);
+        circular_array *a = array.load(std::memory_order_relaxed);
+        if (b - t > a->capacity - 1) {
+            // the array is full
+            circular_array *const bigger = a->grow(b, t);
+            retired_arrays.emplace_back(a);
+            array.store(bigger, std::memory_order_release);
+            a = bigger;
+        }
+        a->put(b, value);
+        // the item has to be visible before a thief can see the new bottom
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Takes the most recently pushed item. Must only be called by the owner.
+     * @return false if the deque is empty.
+     */
+    bool pop(T &value) {
+        const std::int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        circular_array *const a = array.load(std::memory_order_relaxed);
+        // reserve the bottom item first, then look at top. The fence pairs with the one
+        // in steal(), so the owner and a thief can't both miss each other's update.
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        std::int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            // the deque was empty, restore bottom
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return false;
+        }
+        const T item = a->get(b);
+        if (t == b) {
+            // the last item: race against the thieves for it
+            const bool won = top.compare_exchange_strong(t, t + 1,
+                                                         std::memory_order_seq_cst,
+                                                         std::memory_order_relaxed);
+            bottom.store(b + 1, std::memory_order_relaxed);
+            if (!won) {
+                return false;
+            }
+        }
+        value = item;
+        return true;
+    }
+
+    /**
+     * Takes the oldest item. May be called by any thread.
+     * @return false if the deque is empty or another thread took the item first.
+     */
+    bool steal(T &value) {
+        std::int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const std::int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return false;
+        }
+        circular_array *const a = array.load(std::memory_order_acquire);
+        const T item = a->get(t);
+        if (!top.compare_exchange_strong(t, t + 1,
+                                         std::memory_order_seq_cst,
+                                         std::memory_order_relaxed)) {
+            // the owner or another thief took it
+            return false;
+        }
+        value = item;
+        return true;
+    }
+
+    /**
+     * The answer is only a snapshot, unless it is called by the owner
+     * while no other thread can push.
+     */
+    bool empty() const {
+        const std::int64_t b = bottom.load(std::memory_order_relaxed);
+        const std::int64_t t = top.load(std::memory_order_relaxed);
+        return b <= t;
+    }
+};
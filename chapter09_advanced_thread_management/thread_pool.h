@@ -0,0 +1,318 @@
+#pragma once
+
+#include "atomic"
+#include "chrono"
+#include "condition_variable"
+#include "cstddef"
+#include "future"
+#include "memory"
+#include "mutex"
+#include "thread"
+#include "type_traits"
+#include "utility"
+#include "vector"
+#include "chapter02/joining_thread.h"
+#include "chapter06_lock_based_data_structures/thread_safe_queue_revised.h"
+#include "chapter08/work_stealing_deque.h"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/**
+ * Type erased wrapper over a callable with no parameters. Unlike std::function it only
+ * requires the callable to be movable, so it can store std::packaged_task instances.
+ */
+class function_wrapper {
+    struct impl_base {
+        virtual void call() = 0;
+
+        virtual ~impl_base() {}
+    };
+
+    template<typename F>
+    struct impl_type : impl_base {
+        F f;
+
+        explicit impl_type(F &&f_) : f(std::move(f_)) {}
+
+        void call() override {
+            f();
+        }
+    };
+
+    std::unique_ptr<impl_base> impl;
+
+public:
+    function_wrapper() = default;
+
+    template<typename F>
+    function_wrapper(F f) : impl(new impl_type<F>(std::move(f))) {}
+
+    function_wrapper(function_wrapper &&other) noexcept: impl(std::move(other.impl)) {}
+
+    function_wrapper &operator=(function_wrapper &&other) noexcept {
+        impl = std::move(other.impl);
+        return *this;
+    }
+
+    function_wrapper(const function_wrapper &) = delete;
+
+    function_wrapper &operator=(const function_wrapper &) = delete;
+
+    void operator()() {
+        impl->call();
+    }
+};
+
+/**
+ * Thread pool with a fixed number of worker threads that run submitted tasks and
+ * hand their results back through std::future.
+ *
+ * Tasks submitted from outside the pool go to a global queue. Tasks submitted by a task
+ * that already runs on a worker thread (e.g. the recursive calls of a divide and conquer
+ * algorithm) go to that worker's own work stealing deque, so workers don't contend on
+ * a single queue. A worker looks for work in its own deque first, then in the global
+ * queue, and finally steals from the deques of the other workers.
+ *
+ * A task that waits for the result of another task must not simply block on the future:
+ * if all workers do that, nobody is left to run the tasks they are waiting for.
+ * Such a task should wait with wait_for_result() (or call run_pending_task() in a loop) instead.
+ */
+class thread_pool {
+    using task_type = function_wrapper;
+    using local_queue_type = work_stealing_deque<task_type *>;
+
+    std::atomic<bool> done;
+    const bool pin_threads;
+    ThreadSafeQueueRevised<task_type> pool_work_queue;
+    std::vector<std::unique_ptr<local_queue_type>> queues;
+    /**
+     * Idle workers sleep on idle_condition until a task is submitted. work_epoch is incremented
+     * on every submit, so a worker that saw no work since it last read the epoch knows it may sleep.
+     * Submitters only take idle_mutex when some worker is asleep. Declared before threads, so they
+     * outlive the workers when the constructor throws.
+     */
+    std::mutex idle_mutex;
+    std::condition_variable idle_condition;
+    std::atomic<std::size_t> work_epoch;
+    std::atomic<unsigned> idle_workers;
+    std::vector<std::thread> threads;
+    // declared after threads, so if the constructor throws it joins the workers started so far
+    join_threads joiner;
+
+    // worker threads of a pool point these at their own deque. For all other threads they are nullptr.
+    inline static thread_local thread_pool *current_pool = nullptr;
+    inline static thread_local local_queue_type *local_work_queue = nullptr;
+    inline static thread_local unsigned my_index = 0;
+
+    bool is_worker_thread() const {
+        return current_pool == this;
+    }
+
+    /**
+     * Binds the calling thread to a single CPU, so the scheduler doesn't migrate it
+     * away from the data it has in its caches. Does nothing where it isn't supported.
+     */
+    static void pin_current_thread(unsigned cpu) {
+#ifdef __linux__
+        const unsigned cpu_count = std::thread::hardware_concurrency();
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu_count ? cpu % cpu_count : 0, &cpus);
+        // pinning is only an optimization, so a failure is ignored
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#else
+        (void) cpu;
+#endif
+    }
+
+    void worker_thread(unsigned index) {
+        if (pin_threads) {
+            pin_current_thread(index);
+        }
+        current_pool = this;
+        my_index = index;
+        local_work_queue = queues[index].get();
+        while (!done) {
+            // read before looking for work, so a task submitted after the search changes it
+            const std::size_t seen_epoch = work_epoch.load();
+            if (!try_run_pending_task()) {
+                wait_for_work(seen_epoch);
+            }
+        }
+    }
+
+    /**
+     * Blocks until a task has been submitted since [seen_epoch] was read, or the pool stops.
+     */
+    void wait_for_work(std::size_t seen_epoch) {
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        // incremented before the epoch is checked: a submitter either sees a sleeper and notifies it,
+        // or the check below sees the new epoch
+        ++idle_workers;
+        idle_condition.wait(lock, [&] { return done || work_epoch.load() != seen_epoch; });
+        --idle_workers;
+    }
+
+    /**
+     * Wakes up one sleeping worker after a task has been pushed to any of the queues.
+     */
+    void notify_work() {
+        ++work_epoch;
+        if (idle_workers.load() != 0) {
+            // taking the lock makes sure the worker is either waiting already or hasn't checked the epoch yet
+            { std::lock_guard<std::mutex> lock(idle_mutex); }
+            idle_condition.notify_one();
+        }
+    }
+
+    void wake_all_workers() {
+        { std::lock_guard<std::mutex> lock(idle_mutex); }
+        idle_condition.notify_all();
+    }
+
+    bool pop_task_from_local_queue(task_type *&task) {
+        return is_worker_thread() && local_work_queue->pop(task);
+    }
+
+    bool pop_task_from_other_thread_queue(task_type *&task) {
+        for (unsigned i = 0; i < queues.size(); ++i) {
+            const unsigned index = (my_index + i + 1) % queues.size();
+            if (queues[index]->steal(task)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool try_run_pending_task() {
+        task_type *local_task = nullptr;
+        if (pop_task_from_local_queue(local_task)) {
+            std::unique_ptr<task_type> task(local_task);
+            (*task)();
+            return true;
+        }
+        task_type task;
+        if (pool_work_queue.TryPop(task)) {
+            task();
+            return true;
+        }
+        if (pop_task_from_other_thread_queue(local_task)) {
+            std::unique_ptr<task_type> stolen_task(local_task);
+            (*stolen_task)();
+            return true;
+        }
+        return false;
+    }
+
+    void stop() {
+        done = true;
+        pool_work_queue.Close();
+        wake_all_workers();
+        for (auto &t : threads) {
+            t.join();
+        }
+    }
+
+public:
+    /**
+     * @param thread_count number of worker threads.
+     * @param pin_threads_to_cpus bind worker i to CPU i (modulo the number of CPUs). Helps
+     *          memory bound work that is split evenly between the workers, but hurts when
+     *          the pool shares the machine with other busy threads.
+     */
+    explicit thread_pool(unsigned thread_count = std::thread::hardware_concurrency(),
+                         bool pin_threads_to_cpus = false) :
+            done(false), pin_threads(pin_threads_to_cpus), work_epoch(0), idle_workers(0), joiner(threads) {
+        if (thread_count == 0) {
+            thread_count = 1;
+        }
+        // all deques must exist before the first worker starts stealing
+        for (unsigned i = 0; i < thread_count; ++i) {
+            queues.emplace_back(new local_queue_type);
+        }
+        try {
+            for (unsigned i = 0; i < thread_count; ++i) {
+                threads.emplace_back(&thread_pool::worker_thread, this, i);
+            }
+        } catch (...) {
+            // let the already started workers finish, joiner joins them
+            done = true;
+            pool_work_queue.Close();
+            wake_all_workers();
+            throw;
+        }
+    }
+
+    ~thread_pool() {
+        stop();
+        // the workers are gone, so this thread can act as the owner of their deques
+        for (auto &queue : queues) {
+            task_type *task = nullptr;
+            while (queue->pop(task)) {
+                delete task;
+            }
+        }
+    }
+
+    thread_pool(const thread_pool &) = delete;
+
+    thread_pool &operator=(const thread_pool &) = delete;
+
+    unsigned size() const {
+        return static_cast<unsigned>(threads.size());
+    }
+
+    template<typename FunctionType>
+    std::future<std::invoke_result_t<FunctionType>> submit(FunctionType f) {
+        using result_type = std::invoke_result_t<FunctionType>;
+        std::packaged_task<result_type()> task(std::move(f));
+        std::future<result_type> res(task.get_future());
+        if (is_worker_thread()) {
+            std::unique_ptr<task_type> local_task(new task_type(std::move(task)));
+            local_work_queue->push(local_task.get());
+            local_task.release();
+        } else {
+            pool_work_queue.Push(task_type(std::move(task)));
+        }
+        notify_work();
+        return res;
+    }
+
+    /**
+     * Runs one pending task, if there is any, on the calling thread.
+     * Otherwise yields the rest of the time slice.
+     */
+    void run_pending_task() {
+        if (!try_run_pending_task()) {
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     * Returns the value of [result] (or rethrows its exception). A worker thread keeps itself
+     * busy with pending tasks until the result is ready. Any other thread simply blocks:
+     * it doesn't hold up the workers, and running tasks on it would only nest them deeper
+     * and deeper on its stack.
+     */
+    template<typename ResultType>
+    ResultType wait_for_result(std::future<ResultType> &result) {
+        if (is_worker_thread()) {
+            while (result.wait_for(std::chrono::seconds(0)) == std::future_status::timeout) {
+                run_pending_task();
+            }
+        }
+        return result.get();
+    }
+};
+
+/**
+ * Pool shared by the parallel algorithms, so they don't have to create threads on every call.
+ * It is created on first use.
+ */
+inline thread_pool &default_thread_pool() {
+    static thread_pool pool;
+    return pool;
+}
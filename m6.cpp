@@ -0,0 +1,4 @@
+int mainChapter6(); int mainChapter7();
+#include <cstdlib>
+#include <cstdio>
+int main(int argc,char**argv){ if(argv[1][0]=='6') mainChapter6(); else mainChapter7(); std::puts("returning"); return 0;}